@@ -0,0 +1,67 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Checksums of recently seen payloads, so that a payload the server has
+ * already hashed is answered without running SHA-256 again. Entries keep
+ * a copy of the payload and are found by length and a fingerprint of the
+ * first CACHE_PREFIX bytes. A payload is matched against its candidate
+ * byte for byte as it arrives, so a hit never returns the wrong checksum
+ * and nothing has to be buffered to look a payload up. Least recently
+ * used entries are evicted to keep the entries (payload copies included)
+ * within a byte budget. All functions are safe to call from any thread. */
+struct result_cache;
+struct cache_entry;
+
+#define CACHE_PREFIX 64
+
+enum cache_match_state {
+	CACHE_OFF,       /* not matching a payload */
+	CACHE_MATCHING,  /* every byte so far matches a cached payload, or too
+	                    few have arrived to pick one */
+	CACHE_MISS,      /* no cached payload matches; copying it to insert */
+};
+
+/* One payload being received. Lives in the connection, no allocation
+ * until the payload misses. */
+struct cache_match {
+	struct result_cache *cache;
+	enum cache_match_state state;
+	size_t len;                  /* of the whole payload */
+	size_t fed;                  /* bytes seen so far */
+	size_t prefix_len;           /* min(len, CACHE_PREFIX) */
+	struct cache_entry *cand;    /* pinned candidate, NULL if none */
+	struct cache_entry *fill;    /* copy to insert, NULL if it didn't fit */
+	uint8_t prefix[CACHE_PREFIX];
+};
+
+/* Create a cache for checksums salted with salt (len bytes, may be 0)
+ * holding at most budget bytes. Returns NULL on error */
+struct result_cache *cache_create(const uint8_t *salt, size_t len, size_t budget);
+
+/* Start matching a len-byte payload. With a NULL cache or len 0 the match
+ * stays CACHE_OFF and every other call does nothing. */
+void cache_match_begin(struct cache_match *m, struct result_cache *cache, size_t len);
+
+/* The next n bytes of the payload arrived. Returns 1 while the payload may
+ * still be answered from the cache: the caller should not hash yet. */
+int cache_match_feed(struct cache_match *m, const uint8_t *p, size_t n);
+
+/* Once cache_match_feed returns 0 after having returned 1, the bytes the
+ * caller held back can be hashed from here; valid up to the bytes fed
+ * before that call. */
+const uint8_t *cache_match_seen(const struct cache_match *m);
+
+/* After the whole payload was fed: if it matched, copy its checksum into
+ * out (32 bytes) and return 1. Returns 0 on a miss. */
+int cache_match_hit(struct cache_match *m, uint8_t *out);
+
+/* Finish the match. A missed payload that arrived in full is inserted
+ * with checksum; a NULL checksum (the client went away) drops it. */
+void cache_match_end(struct cache_match *m, const uint8_t *checksum);
+
+void cache_destroy(struct result_cache *cache);
+
+#endif
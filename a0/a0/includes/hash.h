@@ -20,6 +20,31 @@ struct checksum_ctx * checksum_create(const uint8_t *salt, size_t len);
  */
 int checksum_update(struct checksum_ctx *, const uint8_t *payload);
 
+/* Relaxed form of checksum_update that takes any number of bytes. Bytes
+ * that don't complete a 64-byte SHA-256 block are buffered in the context
+ * until the next update or checksum_finish, so a payload can be fed in
+ * exactly the pieces it arrives in. It can be mixed freely with the other
+ * update calls. Function returns 0 on success.
+ */
+int checksum_update_bytes(struct checksum_ctx *, const uint8_t *data, size_t len);
+
+/* Batch form of checksum_update: add payload[i] (4096 bytes each) to
+ * ctx[i] for i < n. The contexts must be distinct. The buffers are hashed
+ * side by side with a multi-buffer SHA-256 kernel (16 lanes with AVX-512,
+ * 8 with AVX2) chosen at runtime from the CPU features. Without AVX-512 on
+ * a CPU with the SHA extensions, hashing one buffer at a time is faster
+ * and is used instead. The CHECKSUM_KERNEL environment variable (serial,
+ * avx2 or avx512) overrides the choice. Function returns 0 on success.
+ */
+int checksum_update_many(struct checksum_ctx *ctx[], const uint8_t *payload[], size_t n);
+
+/* Name of the kernel checksum_update_many uses */
+const char *checksum_kernel_name(void);
+
+/* Force a kernel by name (serial, avx2 or avx512). Returns 0 on success,
+ * non-zero if the CPU cannot run it. */
+int checksum_use_kernel(const char *name);
+
 /* With a valid context, add the payload (with a specified length) to
  * the current hash and output the full checksum into out. out must
  * have enough space to write 32 bytes of output. Function returns 0
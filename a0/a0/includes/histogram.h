@@ -0,0 +1,36 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/* HDR-style latency histogram. Values below 2^HIST_SUB_BITS get a bucket
+ * each; above that every power of two is split into 2^HIST_SUB_BITS linear
+ * sub-buckets, so any recorded value is reported to within 1% while the
+ * whole uint64_t range fits in a fixed table. Recording is a couple of
+ * shifts and an increment, cheap enough to do on every request. */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+void hist_init(struct histogram *h);
+
+void hist_record(struct histogram *h, uint64_t value);
+
+/* Add every value recorded in src to dst */
+void hist_merge(struct histogram *dst, const struct histogram *src);
+
+/* Smallest recorded value v such that at least p percent of the values are
+ * <= v, rounded up to its bucket's upper bound. Returns 0 if empty. */
+uint64_t hist_percentile(const struct histogram *h, double p);
+
+double hist_mean(const struct histogram *h);
+
+#endif
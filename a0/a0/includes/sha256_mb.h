@@ -0,0 +1,20 @@
+#ifndef SHA256_MB_H
+#define SHA256_MB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Multi-buffer SHA-256 compression: run nblocks 64-byte blocks through 8
+ * (AVX2) or 16 (AVX-512) independent hash states in one pass, one state per
+ * SIMD lane. state[i] points at the eight words of lane i's state and is
+ * updated in place. Lane i reads its first block from first[i] and block
+ * j >= 1 from rest[i] + 64*(j-1), so a caller can prepend bytes buffered by
+ * a previous update without copying the rest of the message.
+ *
+ * The caller must check CPU support before calling either kernel. */
+void sha256_x8_avx2(uint32_t *state[8], const uint8_t *first[8],
+                    const uint8_t *rest[8], size_t nblocks);
+void sha256_x16_avx512(uint32_t *state[16], const uint8_t *first[16],
+                       const uint8_t *rest[16], size_t nblocks);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* Process-wide counters for the server. The server allocates through the
+ * stats_ wrappers below, so a dump taken between two identical workloads
+ * shows whether the request path allocates at all. Allocations inside libc
+ * and OpenSSL are not seen. Syscalls are counted by the server at each
+ * socket and epoll call on the request path. */
+struct server_stats {
+	uint64_t allocs;       /* stats_malloc, _calloc, _realloc and _posix_memalign */
+	uint64_t alloc_bytes;  /* bytes requested by the above */
+	uint64_t frees;
+	uint64_t syscalls;     /* recv, send, sendmsg, epoll_wait and epoll_ctl */
+	uint64_t requests;     /* HashRequests answered */
+	uint64_t cache_hits;   /* answered from the result cache */
+	uint64_t cache_misses; /* cacheable payloads that had to be hashed */
+};
+
+/* malloc and friends, counted */
+void *stats_malloc(size_t size);
+void *stats_calloc(size_t nmemb, size_t size);
+void *stats_realloc(void *ptr, size_t size);
+int stats_posix_memalign(void **memptr, size_t alignment, size_t size);
+void stats_free(void *ptr);
+
+void stats_count_syscall(void);
+void stats_count_request(void);
+void stats_count_cache(int hit);
+
+/* Take a snapshot of the counters. Safe to call from any thread. */
+void stats_get(struct server_stats *out);
+
+/* Print the counters, plus the change since the previous dump, to fp. */
+void stats_dump(FILE *fp);
+
+/* Dump to fp on every SIGUSR1, from a thread of its own, so an idle or busy
+ * server answers right away. Call before creating any other thread: it
+ * blocks SIGUSR1 in the caller, and threads created later inherit that.
+ * Returns -1 on error. */
+int stats_start_dump_thread(FILE *fp);
+
+#endif
@@ -0,0 +1,296 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "stats.h"
+
+#define FP_MULT 0x9e3779b97f4a7c15ull
+#define MIN_BUCKETS 256
+
+struct cache_entry {
+	struct cache_entry *hnext;   /* hash chain */
+	struct cache_entry *prev;    /* LRU list, most recent first */
+	struct cache_entry *next;
+	uint64_t fp;
+	size_t len;
+	int refs;                    /* matches holding it as their candidate */
+	int dead;                    /* evicted while pinned, freed on the last unpin */
+	uint8_t checksum[32];
+	uint8_t data[];
+};
+
+struct result_cache {
+	pthread_mutex_t lock;
+	uint64_t seed;               /* fingerprint of the salt */
+	size_t budget;
+	size_t used;
+	size_t mask;                 /* buckets - 1 */
+	struct cache_entry **buckets;
+	struct cache_entry lru;      /* sentinel: lru.next is the newest entry */
+};
+
+static size_t entry_size(size_t len) {
+	return sizeof(struct cache_entry) + len;
+}
+
+/* Multiply-xorshift over 8-byte words, seeded with the whole payload's
+ * length so payloads that differ only in trailing zeros still
+ * fingerprint differently */
+static uint64_t fingerprint(uint64_t seed, const uint8_t *p, size_t len, size_t total) {
+	uint64_t h = seed ^ (total * FP_MULT);
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, p + i, 8);
+		h = (h ^ w) * FP_MULT;
+		h ^= h >> 29;
+	}
+	if (i < len) {
+		uint64_t w = 0;
+		memcpy(&w, p + i, len - i);
+		h = (h ^ w) * FP_MULT;
+	}
+	return h ^ (h >> 32);
+}
+
+static size_t prefix_len(size_t len) {
+	return len < CACHE_PREFIX ? len : CACHE_PREFIX;
+}
+
+struct result_cache *cache_create(const uint8_t *salt, size_t len, size_t budget) {
+	struct result_cache *cache = stats_calloc(1, sizeof(*cache));
+	if (!cache) {
+		return NULL;
+	}
+
+	/* Roughly one bucket per page-sized payload the budget can hold */
+	size_t buckets = MIN_BUCKETS;
+	while (buckets < budget / 4096) {
+		buckets *= 2;
+	}
+	if (!(cache->buckets = stats_calloc(buckets, sizeof(*cache->buckets)))) {
+		stats_free(cache);
+		return NULL;
+	}
+
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->seed = fingerprint(0, salt, len, len);
+	cache->budget = budget;
+	cache->mask = buckets - 1;
+	cache->lru.prev = cache->lru.next = &cache->lru;
+	return cache;
+}
+
+static void lru_unlink(struct cache_entry *e) {
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void lru_push(struct result_cache *cache, struct cache_entry *e) {
+	e->prev = &cache->lru;
+	e->next = cache->lru.next;
+	e->next->prev = e;
+	cache->lru.next = e;
+}
+
+/* Newest entry of length len whose first cmp_len bytes are data's.
+ * Caller holds the lock */
+static struct cache_entry *find(struct result_cache *cache, const uint8_t *data,
+                                size_t cmp_len, size_t len, uint64_t fp) {
+	struct cache_entry *e = cache->buckets[fp & cache->mask];
+	for (; e; e = e->hnext) {
+		if (e->fp == fp && e->len == len && memcmp(e->data, data, cmp_len) == 0) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/* Caller holds the lock */
+static void evict(struct result_cache *cache, struct cache_entry *victim) {
+	struct cache_entry **link = &cache->buckets[victim->fp & cache->mask];
+	while (*link != victim) {
+		link = &(*link)->hnext;
+	}
+	*link = victim->hnext;
+	lru_unlink(victim);
+	cache->used -= entry_size(victim->len);
+	if (victim->refs) {
+		victim->dead = 1;
+	} else {
+		stats_free(victim);
+	}
+}
+
+static void unpin(struct result_cache *cache, struct cache_entry *e) {
+	pthread_mutex_lock(&cache->lock);
+	if (--e->refs == 0 && e->dead) {
+		stats_free(e);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static void insert(struct result_cache *cache, struct cache_entry *e, const uint8_t *checksum) {
+	size_t size = entry_size(e->len);
+
+	e->fp = fingerprint(cache->seed, e->data, prefix_len(e->len), e->len);
+	e->refs = 0;
+	e->dead = 0;
+	memcpy(e->checksum, checksum, 32);
+
+	pthread_mutex_lock(&cache->lock);
+	if (find(cache, e->data, e->len, e->len, e->fp)) {
+		/* Another connection missed on the same payload and got here first */
+		pthread_mutex_unlock(&cache->lock);
+		stats_free(e);
+		return;
+	}
+	while (cache->used + size > cache->budget) {
+		evict(cache, cache->lru.prev);
+	}
+	e->hnext = cache->buckets[e->fp & cache->mask];
+	cache->buckets[e->fp & cache->mask] = e;
+	lru_push(cache, e);
+	cache->used += size;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_match_begin(struct cache_match *m, struct result_cache *cache, size_t len) {
+	m->cache = cache;
+	m->state = cache && len ? CACHE_MATCHING : CACHE_OFF;
+	m->len = len;
+	m->fed = 0;
+	m->prefix_len = prefix_len(len);
+	m->cand = NULL;
+	m->fill = NULL;
+}
+
+/* Start the copy to insert from the bytes seen so far. Payloads larger
+ * than the budget are not cached. */
+static void miss(struct cache_match *m) {
+	size_t size = entry_size(m->len);
+
+	m->state = CACHE_MISS;
+	if (size <= m->cache->budget && (m->fill = stats_malloc(size))) {
+		m->fill->len = m->len;
+		memcpy(m->fill->data, m->cand ? m->cand->data : m->prefix, m->fed);
+	}
+}
+
+/* The payload stopped matching its candidate: switch to another entry that
+ * matches every byte so far, the n at p included, if there is one */
+static int rematch(struct cache_match *m, const uint8_t *p, size_t n) {
+	struct result_cache *cache = m->cache;
+	struct cache_entry *old = m->cand;
+	struct cache_entry *e;
+
+	pthread_mutex_lock(&cache->lock);
+	for (e = cache->buckets[old->fp & cache->mask]; e; e = e->hnext) {
+		if (e != old && e->fp == old->fp && e->len == old->len &&
+		    memcmp(e->data, old->data, m->fed) == 0 &&
+		    memcmp(e->data + m->fed, p, n) == 0) {
+			e->refs++;
+			m->cand = e;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+	if (e) {
+		unpin(cache, old);
+	}
+	return e != NULL;
+}
+
+int cache_match_feed(struct cache_match *m, const uint8_t *p, size_t n) {
+	if (m->state == CACHE_OFF) {
+		return 0;
+	}
+
+	/* Too few bytes yet to pick a candidate */
+	if (m->state == CACHE_MATCHING && m->fed < m->prefix_len) {
+		size_t k = m->prefix_len - m->fed < n ? m->prefix_len - m->fed : n;
+		memcpy(m->prefix + m->fed, p, k);
+		m->fed += k;
+		p += k;
+		n -= k;
+		if (m->fed < m->prefix_len) {
+			return 1;
+		}
+
+		struct result_cache *cache = m->cache;
+		uint64_t fp = fingerprint(cache->seed, m->prefix, m->prefix_len, m->len);
+		pthread_mutex_lock(&cache->lock);
+		if ((m->cand = find(cache, m->prefix, m->prefix_len, m->len, fp))) {
+			m->cand->refs++;
+		}
+		pthread_mutex_unlock(&cache->lock);
+		if (!m->cand) {
+			miss(m);
+		}
+	}
+
+	/* The candidate is pinned and immutable, so no lock is needed */
+	if (m->state == CACHE_MATCHING) {
+		if (memcmp(m->cand->data + m->fed, p, n) == 0 || rematch(m, p, n)) {
+			m->fed += n;
+			return 1;
+		}
+		miss(m);
+	}
+
+	if (m->fill) {
+		memcpy(m->fill->data + m->fed, p, n);
+	}
+	m->fed += n;
+	return 0;
+}
+
+const uint8_t *cache_match_seen(const struct cache_match *m) {
+	return m->fill ? m->fill->data : m->cand ? m->cand->data : m->prefix;
+}
+
+int cache_match_hit(struct cache_match *m, uint8_t *out) {
+	if (m->state != CACHE_MATCHING || m->fed != m->len) {
+		return 0;
+	}
+
+	struct result_cache *cache = m->cache;
+	pthread_mutex_lock(&cache->lock);
+	memcpy(out, m->cand->checksum, 32);
+	if (!m->cand->dead) {
+		lru_unlink(m->cand);
+		lru_push(cache, m->cand);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return 1;
+}
+
+void cache_match_end(struct cache_match *m, const uint8_t *checksum) {
+	if (m->state == CACHE_OFF) {
+		return;
+	}
+	if (m->fill) {
+		if (checksum && m->fed == m->len) {
+			insert(m->cache, m->fill, checksum);
+		} else {
+			stats_free(m->fill);
+		}
+	}
+	if (m->cand) {
+		unpin(m->cache, m->cand);
+	}
+	m->state = CACHE_OFF;
+	m->cand = NULL;
+	m->fill = NULL;
+}
+
+void cache_destroy(struct result_cache *cache) {
+	while (cache->lru.next != &cache->lru) {
+		evict(cache, cache->lru.next);
+	}
+	pthread_mutex_destroy(&cache->lock);
+	stats_free(cache->buckets);
+	stats_free(cache);
+}
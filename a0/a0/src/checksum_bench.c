@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+/* third party libraries */
+#include <openssl/evp.h>
+
+/* Microbenchmark for checksum_update_many. Every available kernel hashes
+ * the same set of concurrent 4096-byte payload streams, is checked against
+ * one EVP_MD_CTX per stream, and is timed next to that EVP path.
+ *
+ * usage: checksum_bench [streams] [blocks per stream] */
+
+#define SALT "What a tasty salt you are"
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* One EVP digest per stream, fed block by block like the old hash.c */
+static double run_evp(uint8_t *data, size_t streams, size_t blocks, uint8_t (*out)[32]) {
+	double start = now();
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+	for (size_t s = 0; s < streams; s++) {
+		EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+		EVP_DigestUpdate(ctx, SALT, sizeof(SALT) - 1);
+		for (size_t b = 0; b < blocks; b++) {
+			EVP_DigestUpdate(ctx, data + (b * streams + s) * UPDATE_PAYLOAD_SIZE, UPDATE_PAYLOAD_SIZE);
+		}
+		EVP_DigestFinal_ex(ctx, out[s], NULL);
+	}
+	EVP_MD_CTX_free(ctx);
+	return now() - start;
+}
+
+/* All streams advance one block per checksum_update_many call */
+static double run_batch(uint8_t *data, size_t streams, size_t blocks, uint8_t (*out)[32]) {
+	struct checksum_ctx **ctx = calloc(streams, sizeof(*ctx));
+	const uint8_t **payload = calloc(streams, sizeof(*payload));
+
+	for (size_t s = 0; s < streams; s++) {
+		ctx[s] = checksum_create((const uint8_t *)SALT, sizeof(SALT) - 1);
+	}
+
+	double start = now();
+	for (size_t b = 0; b < blocks; b++) {
+		for (size_t s = 0; s < streams; s++) {
+			payload[s] = data + (b * streams + s) * UPDATE_PAYLOAD_SIZE;
+		}
+		checksum_update_many(ctx, payload, streams);
+	}
+	for (size_t s = 0; s < streams; s++) {
+		checksum_finish(ctx[s], NULL, 0, out[s]);
+	}
+	double elapsed = now() - start;
+
+	for (size_t s = 0; s < streams; s++) {
+		checksum_destroy(ctx[s]);
+	}
+	free(payload);
+	free(ctx);
+	return elapsed;
+}
+
+int main(int argc, char *argv[]) {
+	size_t streams = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+	size_t blocks = argc > 2 ? strtoul(argv[2], NULL, 10) : 256;
+	size_t total = streams * blocks * UPDATE_PAYLOAD_SIZE;
+	const char *kernels[] = { "serial", "avx2", "avx512" };
+
+	uint8_t *data = malloc(total);
+	uint8_t (*expect)[32] = calloc(streams, 32);
+	uint8_t (*got)[32] = calloc(streams, 32);
+	if (!streams || !blocks || !data || !expect || !got) {
+		fprintf(stderr, "usage: %s [streams] [blocks per stream]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	for (size_t i = 0; i < total; i++) {
+		data[i] = rand();
+	}
+
+	printf("path,streams,MB/s\n");
+	printf("evp,%zu,%.1f\n", streams, total / run_evp(data, streams, blocks, expect) / 1e6);
+
+	for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		if (checksum_use_kernel(kernels[k])) {
+			printf("%s,%zu,unsupported\n", kernels[k], streams);
+			continue;
+		}
+		double elapsed = run_batch(data, streams, blocks, got);
+		if (memcmp(expect, got, streams * 32)) {
+			fprintf(stderr, "%s: checksum mismatch against EVP\n", kernels[k]);
+			return EXIT_FAILURE;
+		}
+		printf("%s,%zu,%.1f\n", kernels[k], streams, total / elapsed / 1e6);
+	}
+
+	free(got);
+	free(expect);
+	free(data);
+	return EXIT_SUCCESS;
+}
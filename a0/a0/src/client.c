@@ -12,6 +12,16 @@
 #include <unistd.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <semaphore.h>
+#include <poll.h>
+
+#define ZEROCOPY_WAIT_MS 100 // for completions before copying instead
 
 struct client_arguments {
 	char ip_address[16]; /* You can store this as a string, but I probably wouldn't */
@@ -21,6 +31,7 @@ struct client_arguments {
 	int smin;
 	int smax;
 	char *filename; /* you can store this as a string, but I probably wouldn't */
+	int window;
 };
 
 error_t client_parser(int key, char *arg, struct argp_state *state) {
@@ -60,6 +71,12 @@ error_t client_parser(int key, char *arg, struct argp_state *state) {
 		args->filename = malloc(len + 1);
 		strcpy(args->filename, arg);
 		break;
+	case 302:
+		args->window = atoi(arg);
+		if (args->window < 1) {
+			argp_error(state, "Window must be at least 1");
+		}
+		break;
 	default:
 		ret = ARGP_ERR_UNKNOWN;
 		break;
@@ -69,6 +86,7 @@ error_t client_parser(int key, char *arg, struct argp_state *state) {
 
 void client_parseopt(struct client_arguments *args, int argc, char *argv[]) {
     bzero(args, sizeof(*args));
+	args->window = 1;
 
 	struct argp_option options[] = {
 		{ "addr", 'a', "addr", 0, "The IP address the server is listening at", 0},
@@ -77,6 +95,7 @@ void client_parseopt(struct client_arguments *args, int argc, char *argv[]) {
 		{ "smin", 300, "minsize", 0, "The minimum size for the data payload in each hash request", 0},
 		{ "smax", 301, "maxsize", 0, "The maximum size for the data payload in each hash request", 0},
 		{ "file", 'f', "file", 0, "The file that the client reads data from for all hash requests", 0},
+		{ "window", 302, "window", 0, "The maximum number of hash requests in flight at once. 1 by default", 0},
 		{0}
 	};
 
@@ -95,10 +114,14 @@ void client_parseopt(struct client_arguments *args, int argc, char *argv[]) {
 
 void send_data(void *buffer, size_t bytes_expected, int send_socket){
     size_t bytes_sent = 0;
-    size_t temp = 0;
+    ssize_t temp = 0;
 
     while(bytes_sent < bytes_expected){
-        temp = send(send_socket, buffer + bytes_sent, bytes_expected-bytes_sent, 0);
+        temp = send(send_socket, buffer + bytes_sent, bytes_expected-bytes_sent, MSG_NOSIGNAL);
+        if(temp < 0){
+            fprintf(stderr, "Connection to server lost.\n");
+            exit(EXIT_FAILURE);
+        }
         bytes_sent += temp;
     }
 }
@@ -106,15 +129,145 @@ void send_data(void *buffer, size_t bytes_expected, int send_socket){
 
 void read_data(void *buffer, size_t bytes_expected, int read_socket){
     size_t bytes_received = 0;
-    size_t temp = 0;
+    ssize_t temp = 0;
 
     while(bytes_received < bytes_expected){
         temp = recv(read_socket, buffer + bytes_received, bytes_expected-bytes_received, MSG_WAITALL);
+        if(temp <= 0){
+            fprintf(stderr, "Connection to server lost.\n");
+            exit(EXIT_FAILURE);
+        }
         bytes_received += temp;
     }
 
 }
 
+
+// Where payload bytes come from. Regular files are streamed from the page
+// cache with sendfile; /dev/zero is a read-only anonymous mapping sent with
+// MSG_ZEROCOPY when the socket supports it. Either way the payload never
+// passes through a user-space buffer.
+struct payload_source {
+    int fd;                 // input file, -1 for /dev/zero
+    off_t offset;           // next unread byte of fd
+    const uint8_t *zeros;   // smax zero bytes
+    int zerocopy;
+};
+
+// MSG_ZEROCOPY completions queue up on the socket's error queue. The zero
+// mapping is never written to, so they only need draining. Returns how many
+// were drained.
+int drain_zerocopy(int sockfd){
+    char control[128];
+    struct msghdr msg;
+    int drained = 0;
+
+    while(1){
+        bzero(&msg, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return drained;
+        drained++;
+    }
+}
+
+// Too many zerocopy sends are unacknowledged. Returns 1 once some of them
+// have completed, 0 if none did within ZEROCOPY_WAIT_MS.
+int wait_zerocopy(int sockfd){
+    if(drain_zerocopy(sockfd) > 0) return 1;
+
+    // Completions raise POLLERR, which poll reports without asking
+    struct pollfd pfd = { sockfd, 0, 0 };
+    return poll(&pfd, 1, ZEROCOPY_WAIT_MS) > 0 && drain_zerocopy(sockfd) > 0;
+}
+
+// Send a HashRequest header, corked with MSG_MORE so it leaves in the same
+// segment as the start of its payload, followed by len payload bytes
+void send_request(uint32_t *header, struct payload_source *src, size_t len, int send_socket){
+    size_t sent = 0;
+    ssize_t temp;
+
+    while(sent < 8){
+        temp = send(send_socket, (uint8_t *)header + sent, 8 - sent, MSG_MORE | MSG_NOSIGNAL);
+        if(temp < 0){
+            fprintf(stderr, "Connection to server lost.\n");
+            exit(EXIT_FAILURE);
+        }
+        sent += temp;
+    }
+
+    sent = 0;
+    while(sent < len){
+        if(src->fd >= 0){
+            temp = sendfile(send_socket, src->fd, &src->offset, len - sent);
+        }else{
+            temp = send(send_socket, src->zeros + sent, len - sent, MSG_NOSIGNAL | (src->zerocopy ? MSG_ZEROCOPY : 0));
+            if(temp < 0 && errno == ENOBUFS){
+                if(wait_zerocopy(send_socket)) continue;
+                // Nothing completed: copy this chunk rather than wait longer
+                temp = send(send_socket, src->zeros + sent, len - sent, MSG_NOSIGNAL);
+            }
+        }
+        if(temp <= 0){
+            fprintf(stderr, "Connection to server lost.\n");
+            exit(EXIT_FAILURE);
+        }
+        sent += temp;
+    }
+
+    if(src->zerocopy){
+        drain_zerocopy(send_socket);
+    }
+}
+
+
+// Receive side of a pipelined run. Responses are matched by their counter
+// into a window-sized table and printed in request order; each printed
+// response frees an in-flight slot for the sender.
+struct receiver {
+    int sockfd;
+    int hashnum;
+    int window;
+    sem_t slots;
+    uint8_t (*checksums)[32];   // indexed by counter % window
+    uint8_t *ready;
+};
+
+void *receive_responses(void *arg)
+{
+    struct receiver *r = arg;
+    int next = 0;
+
+    for(int i = 0; i < r->hashnum; i++){
+        uint8_t receive_buffer[40];
+        read_data(receive_buffer, 40, r->sockfd);
+
+        uint32_t counter;
+        memcpy(&counter, receive_buffer + 4, 4);
+        counter = ntohl(counter);
+        if(counter < (uint32_t)next || counter >= (uint32_t)next + r->window){
+            fprintf(stderr, "Unexpected HashResponse counter %u\n", counter);
+            exit(EXIT_FAILURE);
+        }
+
+        int slot = counter % r->window;
+        memcpy(r->checksums[slot], receive_buffer + 8, 32);
+        r->ready[slot] = 1;
+
+        while(r->ready[next % r->window]){
+            slot = next % r->window;
+            printf("%d: 0x", next+1);
+            for(int n = 0; n < 32; n++)	printf("%02x",  r->checksums[slot][n]);
+            putchar('\n');
+
+            r->ready[slot] = 0;
+            next++;
+            sem_post(&r->slots);
+        }
+    }
+    return NULL;
+}
+
 int main(int argc, char *argv[]) {
 
     struct client_arguments args;
@@ -185,6 +338,10 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "\nConnection Failed \n");
         return -1;
     }
+    // Requests are written whole and pipelined, Nagle would only add latency
+    int nodelay = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
     // 3. Communicate
     uint32_t type = htonl(1);
     uint32_t num_req = htonl(args.hashnum);
@@ -202,41 +359,61 @@ int main(int argc, char *argv[]) {
 	total_len = ntohl(total_len);
 
 
-    FILE *file = fopen (args.filename , "r");
-	 
+    struct payload_source src;
+    bzero(&src, sizeof(src));
+    src.fd = -1;
+    if (strcmp(args.filename, "/dev/zero") == 0) {
+        src.zeros = mmap(NULL, args.smax, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(src.zeros == MAP_FAILED){
+            fprintf(stderr, "Cannot map payload buffer.\n");
+            exit(EXIT_FAILURE);
+        }
+        int one = 1;
+        src.zerocopy = setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    } else if ((src.fd = open(args.filename, O_RDONLY)) < 0) {
+        fprintf(stderr, "Cannot open %s.\n", args.filename);
+        exit(EXIT_FAILURE);
+    }
+
+    // Up to args.window HashRequests are outstanding at once; the receiver
+    // thread reads and prints the responses as they come back
+    struct receiver recv_state;
+    recv_state.sockfd = sockfd;
+    recv_state.hashnum = args.hashnum;
+    recv_state.window = args.window;
+    recv_state.checksums = calloc(args.window, 32);
+    recv_state.ready = calloc(args.window, 1);
+    if(!recv_state.checksums || !recv_state.ready || sem_init(&recv_state.slots, 0, args.window) != 0){
+        fprintf(stderr, "Error allocating the request window.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_t receiver_tid;
+    if(pthread_create(&receiver_tid, NULL, receive_responses, &recv_state) != 0){
+        fprintf(stderr, "Error starting the receiver.\n");
+        exit(EXIT_FAILURE);
+    }
 
 	//srand(time(NULL));	
     for(int i = 0; i < args.hashnum; i++){
         uint32_t l =  ((rand()%(args.smax-args.smin+1)) + args.smin);
-		size_t cur_len = 0;
-        uint8_t send_buffer[l];
 
-		while(cur_len < l){
-			size_t bytes_remain = l - cur_len;
-			size_t bytes_read = fread(send_buffer + cur_len, 1, bytes_remain, file);
-			cur_len += bytes_read;
-		}
-		
-		uint32_t hashreq_type = htonl(3);
-		uint32_t random_len_nb = htonl(l);
-		send_data(&hashreq_type, 4, sockfd);
-		send_data(&random_len_nb, 4, sockfd);
-        send_data(send_buffer, l, sockfd);
-
-        uint8_t info_buffer[8] = {0};
-        uint8_t receive_buffer[33] = {0};
-
-        read_data(info_buffer, 8, sockfd);
-        read_data(receive_buffer, 32, sockfd);
-		
-		printf("%d: 0x", i+1);
-		for(int n = 0; n < 32; n++)	printf("%02x",  receive_buffer[n]);
-		
-		putchar('\n');
-        
-    }
-
-    fclose(file);
+        sem_wait(&recv_state.slots);
+
+		uint32_t header[2] = { htonl(3), htonl(l) };
+		send_request(header, &src, l, sockfd);
+    }
+
+    pthread_join(receiver_tid, NULL);
+    sem_destroy(&recv_state.slots);
+    free(recv_state.checksums);
+    free(recv_state.ready);
+
+    if(src.fd >= 0){
+        close(src.fd);
+    }else{
+        munmap((void *)src.zeros, args.smax);
+    }
     close(sockfd);
  
 
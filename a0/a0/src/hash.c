@@ -1,19 +1,22 @@
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 
 #include "hash.h"
+#include "sha256_mb.h"
 
 /* third party libraries */
-#include <openssl/evp.h>
+/* The low-level SHA256_* calls are deprecated in OpenSSL 3 but, unlike
+ * EVP_DigestInit, never allocate. */
+#define OPENSSL_API_COMPAT 0x10100000L
+#include <openssl/sha.h>
 
 /* You shouldn't have to be looking at this file, but have fun! */
 
 
 struct checksum_ctx {
-	EVP_MD_CTX *ctx;
-	const EVP_MD *md;
-	uint8_t *salt;
-	size_t len;
+	SHA256_CTX ctx;
+	SHA256_CTX salted; /* state after absorbing the salt, restored by reset */
 };
 
 
@@ -23,15 +26,11 @@ struct checksum_ctx * checksum_create(const uint8_t *salt, size_t len) {
 		goto err;
 	}
 	memset(csm, 0, sizeof(*csm));
-	csm->ctx = EVP_MD_CTX_new();
-	csm->md = EVP_sha256();
-	csm->len = len;
-	if (len > 0) {
-		csm->salt = malloc(len);
-		if (!csm->salt) {
-			goto err;
-		}
-		memcpy(csm->salt, salt, len);
+	if (SHA256_Init(&csm->salted) != 1) {
+		goto err;
+	}
+	if (len > 0 && SHA256_Update(&csm->salted, salt, len) != 1) {
+		goto err;
 	}
 	if (checksum_reset(csm)) {
 		goto err;
@@ -41,9 +40,6 @@ struct checksum_ctx * checksum_create(const uint8_t *salt, size_t len) {
 
   err:
 	if (csm) {
-		if (csm->salt) {
-			free(csm->salt);
-		}
 		memset(csm, 0, sizeof(*csm));
 		free(csm);
 	}
@@ -53,33 +49,158 @@ struct checksum_ctx * checksum_create(const uint8_t *salt, size_t len) {
 }
 
 int checksum_update(struct checksum_ctx *csm, const uint8_t *payload) {
-	return EVP_DigestUpdate(csm->ctx, payload, UPDATE_PAYLOAD_SIZE) != 1;
+	return SHA256_Update(&csm->ctx, payload, UPDATE_PAYLOAD_SIZE) != 1;
+}
+
+int checksum_update_bytes(struct checksum_ctx *csm, const uint8_t *data, size_t len) {
+	return SHA256_Update(&csm->ctx, data, len) != 1;
+}
+
+enum checksum_kernel {
+	KERNEL_UNKNOWN,
+	KERNEL_SERIAL,   /* SHA256_Update per buffer; OpenSSL uses SHA-NI when present */
+	KERNEL_AVX2,
+	KERNEL_AVX512,
+};
+
+static const char *kernel_names[] = { "unknown", "serial", "avx2", "avx512" };
+static enum checksum_kernel kernel;
+
+static int kernel_supported(enum checksum_kernel k) {
+	__builtin_cpu_init();
+	switch (k) {
+	case KERNEL_SERIAL:
+		return 1;
+	case KERNEL_AVX2:
+		return __builtin_cpu_supports("avx2");
+	case KERNEL_AVX512:
+		return __builtin_cpu_supports("avx512f");
+	default:
+		return 0;
+	}
+}
+
+static enum checksum_kernel pick_kernel(void) {
+	const char *env = getenv("CHECKSUM_KERNEL");
+
+	if (env && checksum_use_kernel(env) == 0) {
+		return kernel;
+	}
+	/* 16 lanes of AVX-512 outrun SHA-NI on one buffer, 8 lanes of AVX2 do not */
+	if (kernel_supported(KERNEL_AVX512)) {
+		return KERNEL_AVX512;
+	}
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sha")) {
+		return KERNEL_SERIAL;
+	}
+	return kernel_supported(KERNEL_AVX2) ? KERNEL_AVX2 : KERNEL_SERIAL;
+}
+
+int checksum_use_kernel(const char *name) {
+	for (enum checksum_kernel k = KERNEL_SERIAL; k <= KERNEL_AVX512; k++) {
+		if (!strcmp(name, kernel_names[k]) && kernel_supported(k)) {
+			kernel = k;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+const char *checksum_kernel_name(void) {
+	if (kernel == KERNEL_UNKNOWN) {
+		kernel = pick_kernel();
+	}
+	return kernel_names[kernel];
+}
+
+/* Feed one 4096-byte payload to each of 8 or 16 contexts. Bytes a context
+ * has buffered from an unaligned salt are prepended to its first block,
+ * and the same number of trailing payload bytes are buffered again
+ * afterwards, exactly as SHA256_Update would do. */
+static void update_lanes(struct checksum_ctx *ctx[], const uint8_t *payload[], size_t lanes) {
+	uint32_t *state[16];
+	const uint8_t *first[16];
+	const uint8_t *rest[16];
+	uint8_t head[16][64];
+
+	for (size_t i = 0; i < lanes; i++) {
+		SHA256_CTX *c = &ctx[i]->ctx;
+		size_t num = c->num;
+
+		state[i] = c->h;
+		if (num) {
+			memcpy(head[i], c->data, num);
+			memcpy(head[i] + num, payload[i], 64 - num);
+			first[i] = head[i];
+		} else {
+			first[i] = payload[i];
+		}
+		rest[i] = payload[i] + 64 - num;
+	}
+
+	if (lanes == 16) {
+		sha256_x16_avx512(state, first, rest, UPDATE_PAYLOAD_SIZE / 64);
+	} else {
+		sha256_x8_avx2(state, first, rest, UPDATE_PAYLOAD_SIZE / 64);
+	}
+
+	for (size_t i = 0; i < lanes; i++) {
+		SHA256_CTX *c = &ctx[i]->ctx;
+		SHA_LONG bits = c->Nl + (UPDATE_PAYLOAD_SIZE << 3);
+
+		if (bits < c->Nl) {
+			c->Nh++;
+		}
+		c->Nl = bits;
+		if (c->num) {
+			memcpy(c->data, payload[i] + UPDATE_PAYLOAD_SIZE - c->num, c->num);
+		}
+	}
+}
+
+int checksum_update_many(struct checksum_ctx *ctx[], const uint8_t *payload[], size_t n) {
+	size_t i = 0;
+
+	checksum_kernel_name();
+	if (kernel == KERNEL_AVX512) {
+		for (; i + 16 <= n; i += 16) {
+			update_lanes(ctx + i, payload + i, 16);
+		}
+	}
+	if (kernel == KERNEL_AVX512 || kernel == KERNEL_AVX2) {
+		for (; i + 8 <= n; i += 8) {
+			update_lanes(ctx + i, payload + i, 8);
+		}
+	}
+	/* Too few left to fill the lanes */
+	for (; i < n; i++) {
+		if (checksum_update(ctx[i], payload[i])) {
+			return 1;
+		}
+	}
+	return 0;
 }
 
 int checksum_finish(struct checksum_ctx *csm, const uint8_t *payload, size_t len, uint8_t *out) {
 	int ret = 1;
 	if (len) {
-		ret = EVP_DigestUpdate(csm->ctx, payload, len);
+		ret = SHA256_Update(&csm->ctx, payload, len);
 	}
 	if (ret == 1) {
-		return EVP_DigestFinal_ex(csm->ctx, out, NULL) != 1;
+		return SHA256_Final(out, &csm->ctx) != 1;
 	} else {
 		return 1;
 	}
 }
 
 int checksum_reset(struct checksum_ctx *csm) {
-	EVP_DigestInit_ex(csm->ctx, csm->md, NULL);
-	if (csm->len) {
-		return EVP_DigestUpdate(csm->ctx, csm->salt, csm->len) != 1;
-	} else {
-		return 0;
-	}
+	/* The salt is absorbed once in checksum_create; resetting is a copy */
+	memcpy(&csm->ctx, &csm->salted, sizeof(csm->ctx));
+	return 0;
 }
 
 int checksum_destroy(struct checksum_ctx *csm) {
-	EVP_MD_CTX_free(csm->ctx);
-	free(csm->salt);
 	memset(csm, 0, sizeof(*csm));
 	free(csm);
 	return 0;
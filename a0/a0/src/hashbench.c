@@ -0,0 +1,524 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <argp.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include "histogram.h"
+
+// Load generator for the hash server. C connections each run a HashRequest
+// session with one request in flight at a time, driven by T non-blocking
+// epoll loops on their own threads, so thousands of connections don't need
+// thousands of threads. Connecting and the Initialization exchange happen in
+// the loops too, so a connection starts sending as soon as the server takes
+// it, even when the server serves one connection at a time. Every request is
+// timed from the first byte sent to the last byte of the HashResponse. The
+// per-loop histograms are merged at the end into one report.
+
+#define MAX_PAYLOAD (1 << 24)
+#define MAX_EPOLL_EVENTS 256
+
+enum output_format { FORMAT_CSV, FORMAT_JSON };
+
+struct bench_arguments {
+	char ip_address[16];
+	int port;
+	int conns;
+	int threads;
+	int hashnum;
+	int smin;
+	int smax;
+	enum output_format format;
+	int header;
+	char *label;
+};
+
+error_t bench_parser(int key, char *arg, struct argp_state *state) {
+	struct bench_arguments *args = state->input;
+	error_t ret = 0;
+	switch(key) {
+	case 'a':
+		strncpy(args->ip_address, arg, sizeof(args->ip_address) - 1);
+		break;
+	case 'p':
+		args->port = atoi(arg);
+		break;
+	case 'c':
+		args->conns = atoi(arg);
+		if (args->conns < 1) {
+			argp_error(state, "Need at least one connection");
+		}
+		break;
+	case 't':
+		args->threads = atoi(arg);
+		if (args->threads < 1) {
+			argp_error(state, "Need at least one thread");
+		}
+		break;
+	case 'n':
+		args->hashnum = atoi(arg);
+		break;
+	case 300:
+		args->smin = atoi(arg);
+		break;
+	case 301:
+		args->smax = atoi(arg);
+		break;
+	case 302:
+		if (strcmp(arg, "csv") == 0) {
+			args->format = FORMAT_CSV;
+		} else if (strcmp(arg, "json") == 0) {
+			args->format = FORMAT_JSON;
+		} else {
+			argp_error(state, "Format must be csv or json");
+		}
+		break;
+	case 303:
+		args->header = 0;
+		break;
+	case 'l':
+		args->label = arg;
+		break;
+	default:
+		ret = ARGP_ERR_UNKNOWN;
+		break;
+	}
+	return ret;
+}
+
+void bench_parseopt(struct bench_arguments *args, int argc, char *argv[]) {
+	bzero(args, sizeof(*args));
+	strcpy(args->ip_address, "127.0.0.1");
+	args->conns = 1;
+	args->threads = 1;
+	args->hashnum = 1000;
+	args->smin = 1;
+	args->smax = 4096;
+	args->format = FORMAT_CSV;
+	args->header = 1;
+	args->label = "";
+
+	struct argp_option options[] = {
+		{ "addr", 'a', "addr", 0, "The IP address the server is listening at. 127.0.0.1 by default", 0},
+		{ "port", 'p', "port", 0, "The port that is being used at the server", 0},
+		{ "conns", 'c', "conns", 0, "The number of concurrent connections. 1 by default", 0},
+		{ "threads", 't', "threads", 0, "The number of epoll loops the connections are spread over. 1 by default", 0},
+		{ "hashreq", 'n', "hashreq", 0, "The number of hash requests each connection sends. 1000 by default", 0},
+		{ "smin", 300, "minsize", 0, "The minimum size for the data payload in each hash request. 1 by default", 0},
+		{ "smax", 301, "maxsize", 0, "The maximum size for the data payload in each hash request. 4096 by default", 0},
+		{ "format", 302, "csv|json", 0, "Report format. csv by default", 0},
+		{ "no-header", 303, 0, 0, "Leave out the CSV header line, for appending to an existing file", 0},
+		{ "label", 'l', "label", 0, "Free-form tag for the run, e.g. the server mode being measured. Quoted as needed in the report", 0},
+		{0}
+	};
+
+	struct argp argp_settings = { options, bench_parser, 0, 0, 0, 0, 0 };
+
+	if (argp_parse(&argp_settings, argc, argv, 0, NULL, args) != 0) {
+		printf("Got error in parse\n");
+	}
+}
+
+uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Start a non-blocking connect; the socket turns writable once it is done
+int connect_server(const struct bench_arguments *args){
+    struct sockaddr_in server_addr;
+    bzero(&server_addr, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(args->port);
+    if(inet_pton(AF_INET, args->ip_address, &server_addr.sin_addr) <= 0){
+        fprintf(stderr, "Invalid address/ Address not supported \n");
+        exit(EXIT_FAILURE);
+    }
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(sockfd < 0){
+        fprintf(stderr, "Socket creation error.\n");
+        exit(EXIT_FAILURE);
+    }
+    if(set_nonblocking(sockfd) < 0){
+        fprintf(stderr, "Error setting up connection.\n");
+        exit(EXIT_FAILURE);
+    }
+    if(connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS){
+        fprintf(stderr, "Connection Failed \n");
+        exit(EXIT_FAILURE);
+    }
+    int nodelay = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return sockfd;
+}
+
+enum conn_phase {
+    CONN_CONNECTING,            // waiting for connect() to finish
+    CONN_INIT,                  // Initialization out, Acknowledgement back
+    CONN_REQUEST,               // HashRequest out, HashResponse back
+};
+
+// One session driven by an event loop. In each exchange a message is sent
+// in full, then its reply is read in full.
+struct bench_conn {
+    int fd;
+    unsigned seed;
+    enum conn_phase phase;
+    int done;                   // requests answered
+    uint32_t events;            // epoll interest currently registered
+    uint32_t header[2];
+    struct iovec iov[2];
+    struct iovec *unsent;       // first of iov still to send
+    int iovcnt;                 // of iov still to send, 0 once sent
+    uint8_t response[40];
+    size_t expect;              // bytes of reply to read
+    size_t got;                 // bytes of reply read
+    uint64_t sent_at;           // now_ns() when the request started
+};
+
+struct bench_loop {
+    pthread_t tid;
+    const struct bench_arguments *args;
+    const uint8_t *payload;
+    struct bench_conn *conns;
+    int nconns;
+    int open;                   // connections with requests left
+    int epfd;
+    pthread_barrier_t *start;
+    struct histogram hist;      // request latency in nanoseconds
+    uint64_t bytes;             // payload bytes hashed
+    uint64_t finished;          // now_ns() after the last response
+};
+
+void start_init(struct bench_loop *loop, struct bench_conn *c)
+{
+    c->phase = CONN_INIT;
+    c->header[0] = htonl(1);
+    c->header[1] = htonl(loop->args->hashnum);
+    c->iov[0].iov_base = c->header;
+    c->iov[0].iov_len = sizeof(c->header);
+    c->unsent = c->iov;
+    c->iovcnt = 1;
+    c->expect = 8;
+    c->got = 0;
+}
+
+void start_request(struct bench_loop *loop, struct bench_conn *c)
+{
+    const struct bench_arguments *args = loop->args;
+    uint32_t l = rand_r(&c->seed) % (args->smax - args->smin + 1) + args->smin;
+
+    c->header[0] = htonl(3);
+    c->header[1] = htonl(l);
+    c->iov[0].iov_base = c->header;
+    c->iov[0].iov_len = sizeof(c->header);
+    c->iov[1].iov_base = (void *)loop->payload;
+    c->iov[1].iov_len = l;
+    c->unsent = c->iov;
+    c->iovcnt = 2;
+    c->expect = sizeof(c->response);
+    c->got = 0;
+    c->sent_at = now_ns();
+    loop->bytes += l;
+}
+
+// Send and receive as far as the socket allows. Returns 1 once the session
+// is over, 0 if it has to wait for want (EPOLLIN or EPOLLOUT).
+int conn_advance(struct bench_loop *loop, struct bench_conn *c, uint32_t *want)
+{
+    if(c->phase == CONN_CONNECTING){
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if(getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err){
+            fprintf(stderr, "Connection Failed \n");
+            exit(EXIT_FAILURE);
+        }
+        start_init(loop, c);
+    }
+
+    while(1){
+        while(c->iovcnt > 0){
+            struct msghdr msg = {
+                .msg_iov = c->unsent,
+                .msg_iovlen = c->iovcnt,
+            };
+            ssize_t temp = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+            if(temp < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+                *want = EPOLLOUT;
+                return 0;
+            }
+            if(temp <= 0){
+                fprintf(stderr, "Connection to server lost.\n");
+                exit(EXIT_FAILURE);
+            }
+            while(c->iovcnt > 0 && (size_t)temp >= c->unsent->iov_len){
+                temp -= c->unsent->iov_len;
+                c->unsent++;
+                c->iovcnt--;
+            }
+            if(c->iovcnt > 0){
+                c->unsent->iov_base = (uint8_t *)c->unsent->iov_base + temp;
+                c->unsent->iov_len -= temp;
+            }
+        }
+
+        while(c->got < c->expect){
+            ssize_t temp = recv(c->fd, c->response + c->got, c->expect - c->got, 0);
+            if(temp < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+                *want = EPOLLIN;
+                return 0;
+            }
+            if(temp <= 0){
+                fprintf(stderr, "Connection to server lost.\n");
+                exit(EXIT_FAILURE);
+            }
+            c->got += temp;
+        }
+
+        if(c->phase == CONN_INIT){
+            uint32_t ack[2];
+            memcpy(ack, c->response, sizeof(ack));
+            if(ntohl(ack[0]) != 2 || ntohl(ack[1]) != (uint32_t)loop->args->hashnum){
+                fprintf(stderr, "Unexpected Acknowledgement from server.\n");
+                exit(EXIT_FAILURE);
+            }
+            c->phase = CONN_REQUEST;
+            start_request(loop, c);
+            continue;
+        }
+
+        hist_record(&loop->hist, now_ns() - c->sent_at);
+
+        uint32_t counter;
+        memcpy(&counter, c->response + 4, 4);
+        if(ntohl(counter) != (uint32_t)c->done){
+            fprintf(stderr, "Unexpected HashResponse counter %u\n", ntohl(counter));
+            exit(EXIT_FAILURE);
+        }
+        if(++c->done == loop->args->hashnum) return 1;
+        start_request(loop, c);
+    }
+}
+
+void run_conn(struct bench_loop *loop, struct bench_conn *c)
+{
+    uint32_t want;
+    if(conn_advance(loop, c, &want)){
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        loop->open--;
+        return;
+    }
+    if(want != c->events){
+        struct epoll_event ev = { .events = want, .data.ptr = c };
+        epoll_ctl(loop->epfd, c->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev);
+        c->events = want;
+    }
+}
+
+void *loop_main(void *arg)
+{
+    struct bench_loop *loop = arg;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+
+    pthread_barrier_wait(loop->start);
+
+    // Each connection goes on to its Initialization once it is writable
+    loop->open = loop->nconns;
+    for(int i = 0; i < loop->nconns; i++){
+        struct bench_conn *c = &loop->conns[i];
+        c->fd = connect_server(loop->args);
+        c->phase = CONN_CONNECTING;
+        c->events = EPOLLOUT;
+        struct epoll_event ev = { .events = c->events, .data.ptr = c };
+        if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0){
+            fprintf(stderr, "epoll_ctl() failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    while(loop->open > 0){
+        int ready = epoll_wait(loop->epfd, events, MAX_EPOLL_EVENTS, -1);
+        if(ready < 0){
+            if(errno == EINTR) continue;
+            fprintf(stderr, "epoll_wait() failed\n");
+            exit(EXIT_FAILURE);
+        }
+        for(int i = 0; i < ready; i++){
+            run_conn(loop, events[i].data.ptr);
+        }
+    }
+    loop->finished = now_ns();
+
+    close(loop->epfd);
+    return NULL;
+}
+
+// The label is free-form; quote it so it can't break the report's syntax
+void print_json_string(const char *s)
+{
+    putchar('"');
+    for(; *s; s++){
+        unsigned char ch = *s;
+        if(ch == '"' || ch == '\\') printf("\\%c", ch);
+        else if(ch < 0x20) printf("\\u%04x", ch);
+        else putchar(ch);
+    }
+    putchar('"');
+}
+
+void print_csv_field(const char *s)
+{
+    if(!strpbrk(s, ",\"\r\n")){
+        fputs(s, stdout);
+        return;
+    }
+    putchar('"');
+    for(; *s; s++){
+        if(*s == '"') putchar('"');
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+void print_report(const struct bench_arguments *args, const struct histogram *h, uint64_t bytes, double seconds)
+{
+    double rps = h->count / seconds;
+    double mbps = bytes / seconds / 1e6;
+    double us[5] = {
+        hist_mean(h) / 1e3,
+        hist_percentile(h, 50.0) / 1e3,
+        hist_percentile(h, 99.0) / 1e3,
+        hist_percentile(h, 99.9) / 1e3,
+        h->max / 1e3,
+    };
+
+    if(args->format == FORMAT_JSON){
+        printf("{\"label\": ");
+        print_json_string(args->label);
+        printf(", \"conns\": %d, \"hashreq\": %d, \"smin\": %d, \"smax\": %d, "
+               "\"requests\": %llu, \"seconds\": %.3f, \"req_per_s\": %.1f, \"mb_per_s\": %.1f, "
+               "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}\n",
+               args->conns, args->hashnum, args->smin, args->smax,
+               (unsigned long long)h->count, seconds, rps, mbps, us[0], us[1], us[2], us[3], us[4]);
+        return;
+    }
+
+    if(args->header){
+        printf("label,conns,hashreq,smin,smax,requests,seconds,req_per_s,mb_per_s,mean_us,p50_us,p99_us,p999_us,max_us\n");
+    }
+    print_csv_field(args->label);
+    printf(",%d,%d,%d,%d,%llu,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+           args->conns, args->hashnum, args->smin, args->smax,
+           (unsigned long long)h->count, seconds, rps, mbps, us[0], us[1], us[2], us[3], us[4]);
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_arguments args;
+
+    bench_parseopt(&args, argc, argv);
+
+    if(args.port <= 0){
+        fprintf(stderr, "A server port is required.\n");
+        exit(EXIT_FAILURE);
+    }
+    if(args.hashnum < 1){
+        fprintf(stderr, "The number of HashRequests (N) should be greater than 0.\n");
+        exit(EXIT_FAILURE);
+    }
+    if(args.smin < 1 || args.smax < args.smin || args.smax > MAX_PAYLOAD){
+        fprintf(stderr, "Payload sizes must satisfy 1 <= smin <= smax <= 2^24.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(args.threads > args.conns){
+        args.threads = args.conns;
+    }
+
+    // All connections send from one buffer; its contents don't change how
+    // long the server takes to hash it
+    uint8_t *payload = malloc(args.smax);
+    struct bench_conn *conns = calloc(args.conns, sizeof(*conns));
+    struct bench_loop *loops = calloc(args.threads, sizeof(*loops));
+    if(!payload || !conns || !loops){
+        fprintf(stderr, "Error allocating benchmark state.\n");
+        exit(EXIT_FAILURE);
+    }
+    for(int i = 0; i < args.smax; i++){
+        payload[i] = rand();
+    }
+
+    for(int i = 0; i < args.conns; i++){
+        conns[i].seed = i + 1;
+    }
+
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, args.threads + 1);
+
+    // Loop i drives connections [i*C/T, (i+1)*C/T)
+    for(int i = 0; i < args.threads; i++){
+        struct bench_loop *loop = &loops[i];
+        int first = (long long)args.conns * i / args.threads;
+        loop->args = &args;
+        loop->payload = payload;
+        loop->conns = conns + first;
+        loop->nconns = (long long)args.conns * (i + 1) / args.threads - first;
+        loop->start = &start;
+        hist_init(&loop->hist);
+        if((loop->epfd = epoll_create1(0)) < 0){
+            fprintf(stderr, "epoll setup failed\n");
+            exit(EXIT_FAILURE);
+        }
+        if(pthread_create(&loop->tid, NULL, loop_main, loop) != 0){
+            fprintf(stderr, "Error starting event loop %d.\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_barrier_wait(&start);
+    uint64_t started = now_ns();
+
+    struct histogram *total = malloc(sizeof(*total));
+    if(!total){
+        fprintf(stderr, "Error allocating benchmark state.\n");
+        exit(EXIT_FAILURE);
+    }
+    hist_init(total);
+
+    uint64_t bytes = 0, finished = started;
+    for(int i = 0; i < args.threads; i++){
+        pthread_join(loops[i].tid, NULL);
+        hist_merge(total, &loops[i].hist);
+        bytes += loops[i].bytes;
+        if(loops[i].finished > finished) finished = loops[i].finished;
+    }
+
+    print_report(&args, total, bytes, (finished - started) / 1e9);
+
+    pthread_barrier_destroy(&start);
+    free(total);
+    free(loops);
+    free(conns);
+    free(payload);
+    return 0;
+}
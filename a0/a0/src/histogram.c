@@ -0,0 +1,70 @@
+#include <string.h>
+
+#include "histogram.h"
+
+static unsigned bucket_of(uint64_t value) {
+	if (value < HIST_SUB_COUNT) {
+		return value;
+	}
+	/* Keep the top HIST_SUB_BITS + 1 bits: the leading one picks the power
+	 * of two, the rest the linear sub-bucket inside it */
+	unsigned shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+	return HIST_SUB_COUNT + shift * HIST_SUB_COUNT + (unsigned)(value >> shift) - HIST_SUB_COUNT;
+}
+
+/* Largest value that lands in bucket b */
+static uint64_t bucket_limit(unsigned b) {
+	if (b < HIST_SUB_COUNT) {
+		return b;
+	}
+	unsigned shift = (b - HIST_SUB_COUNT) / HIST_SUB_COUNT;
+	uint64_t mantissa = (b - HIST_SUB_COUNT) % HIST_SUB_COUNT + HIST_SUB_COUNT;
+	return ((mantissa + 1) << shift) - 1;
+}
+
+void hist_init(struct histogram *h) {
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+void hist_record(struct histogram *h, uint64_t value) {
+	h->buckets[bucket_of(value)]++;
+	h->count++;
+	h->sum += value;
+	if (value < h->min) h->min = value;
+	if (value > h->max) h->max = value;
+}
+
+void hist_merge(struct histogram *dst, const struct histogram *src) {
+	for (unsigned b = 0; b < HIST_BUCKETS; b++) {
+		dst->buckets[b] += src->buckets[b];
+	}
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min) dst->min = src->min;
+	if (src->max > dst->max) dst->max = src->max;
+}
+
+uint64_t hist_percentile(const struct histogram *h, double p) {
+	if (h->count == 0) {
+		return 0;
+	}
+
+	uint64_t rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+	if (rank < 1) rank = 1;
+	if (rank > h->count) rank = h->count;
+
+	uint64_t seen = 0;
+	for (unsigned b = 0; b < HIST_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen >= rank) {
+			uint64_t limit = bucket_limit(b);
+			return limit < h->max ? limit : h->max;
+		}
+	}
+	return h->max;
+}
+
+double hist_mean(const struct histogram *h) {
+	return h->count ? (double)h->sum / h->count : 0.0;
+}
@@ -8,15 +8,38 @@
 #include <unistd.h>
 #include <time.h>
 #include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "hash.h"
+#include "stats.h"
+#include "cache.h"
 #define MAX_CLIENT_QUEUE 10
+#define MAX_EPOLL_EVENTS 64
+#define CONN_POOL_SIZE 64   // connections (and checksum contexts) preallocated per event loop
+#define BENCH_PAYLOAD_SIZE (1 << 20)
+#define BENCH_SECONDS 2
+#define RING_SIZE (4 * UPDATE_PAYLOAD_SIZE)
+#define OUT_QUEUE_SIZE (64 * sizeof(struct hash_response))
+#define MAX_HASH_BATCH 64   // blocks handed to one checksum_update_many call
+#define CACHE_MAX_PAYLOAD (1 << 20) // larger payloads are never cached
+#define CACHE_MAX_MB (1 << 16)
 
 
 struct server_arguments {
 	int port;
 	char *salt;
 	size_t salt_len;
+	int epoll;
+	int threads;
+	int bench;
+	int stream;
+	size_t cache_mb;
+	struct result_cache *cache; // shared by every event loop, NULL when disabled
 };
  
 
@@ -33,9 +56,33 @@ error_t server_parser(int key, char *arg, struct argp_state *state) {
 		break;
 	case 's':
 		args->salt_len = strlen(arg);
-		args->salt = malloc(args->salt_len+1);
+		args->salt = stats_malloc(args->salt_len+1);
 		strcpy(args->salt, arg);
 		break;
+	case 'e':
+		args->epoll = 1;
+		break;
+	case 't':
+		args->threads = atoi(arg);
+		if (args->threads < 1) {
+			argp_error(state, "Number of threads must be at least 1");
+		}
+		break;
+	case 'b':
+		args->bench = 1;
+		break;
+	case 300: {
+		char *end;
+		long mb = strtol(arg, &end, 10);
+		if (*arg == '\0' || *end != '\0' || mb < 1 || mb > CACHE_MAX_MB) {
+			argp_error(state, "--cache-mb must be a number of MB from 1 to %d", CACHE_MAX_MB);
+		}
+		args->cache_mb = mb;
+		break;
+	}
+	case 301:
+		args->stream = 1;
+		break;
 	default:
 		ret = ARGP_ERR_UNKNOWN;
 		break;
@@ -51,6 +98,11 @@ void server_parseopt(struct server_arguments *args, int argc, char *argv[]) {
 	struct argp_option options[] = {
 		{ "port", 'p', "port", 0, "The port to be used for the server" ,0},
 		{ "salt", 's', "salt", 0, "The salt to be used for the server. Zero by default", 0},
+		{ "epoll", 'e', 0, 0, "Serve all clients concurrently from a non-blocking epoll loop instead of one at a time", 0},
+		{ "threads", 't', "threads", 0, "Run this many epoll loops, each on its own SO_REUSEPORT listener", 0},
+		{ "bench", 'b', 0, 0, "Measure MB/s hashed with 1 up to all cores and exit", 0},
+		{ "stream", 301, 0, 0, "Hash payload bytes as soon as they arrive instead of in whole 4096-byte blocks", 0},
+		{ "cache-mb", 300, "megabytes", 0, "Cache checksums of repeated payloads in up to this many MB. Off by default", 0},
 		{0}
 	};
 	struct argp argp_settings = { options, server_parser, 0, 0, 0, 0, 0 };
@@ -79,62 +131,814 @@ void send_data(void *buffer, size_t bytes_expected, int send_socket){
     size_t temp = 0;
 
     while(bytes_sent < bytes_expected){
+        stats_count_syscall();
         temp = send(send_socket, buffer + bytes_sent, bytes_expected-bytes_sent, 0);
         bytes_sent += temp;
     }
 }
 
 
+// Receive whatever has arrived, at least one byte and at most max. Returns
+// the byte count, or <= 0 if the connection is gone.
+ssize_t read_some(void *buffer, size_t max, int read_socket){
+    stats_count_syscall();
+    return recv(read_socket, buffer, max, 0);
+}
+
+
 void read_data(void *buffer, size_t bytes_expected, int read_socket){
     size_t bytes_received = 0;
     size_t temp = 0;
 
     while(bytes_received < bytes_expected){
+        stats_count_syscall();
         temp = recv(read_socket, buffer + bytes_received, bytes_expected-bytes_received, MSG_WAITALL);
         bytes_received += temp;
     }
 
 }
 
-int main(int argc, char *argv[])
+struct checksum_ctx *create_checksum(const struct server_arguments *args)
 {
-    // 1. Create a TCP socket
-    // 2. Bind socket to a port
-    // 3. Set socket to listen
-    // 4. Repeatedly:
-    //  a. Accept new connection
-    //  b. Communicate
-    //  c. Close the connection
-    struct server_arguments args;
+    if(args->salt_len == 0){
+        return checksum_create(NULL, 0);
+    }
+    return checksum_create((uint8_t *)args->salt, args->salt_len);
+}
 
-    //printf("I am the server.\n");
+// Start matching a payload against the result cache, if it is on and the
+// payload is small enough to be cached
+void match_begin(struct cache_match *m, const struct server_arguments *args, uint32_t length)
+{
+    cache_match_begin(m, length <= CACHE_MAX_PAYLOAD ? args->cache : NULL, length);
+}
 
-    server_parseopt(&args, argc, argv);
+// Hand bytes that just arrived to the cache match. Returns 1 while the
+// payload may still be answered from the cache, and hashing has to wait.
+// When it stops matching, the first unhashed bytes it held back are
+// hashed from the match's copy of them.
+int match_payload(struct cache_match *m, struct checksum_ctx *ctx,
+                  const uint8_t *p, size_t n, size_t unhashed)
+{
+    int was_matching = m->state == CACHE_MATCHING;
+    if(cache_match_feed(m, p, n)) return 1;
+    if(was_matching) checksum_update_bytes(ctx, cache_match_seen(m), unhashed);
+    return 0;
+}
+
+// The whole payload arrived: answer from the cache on a hit, otherwise
+// finish the hash with the last tail_len bytes and remember the result
+void finish_payload(struct cache_match *m, struct checksum_ctx *ctx,
+                    const uint8_t *tail, size_t tail_len, uint8_t *out)
+{
+    int hit = cache_match_hit(m, out);
+    if(m->state != CACHE_OFF) stats_count_cache(hit);
+    if(!hit){
+        checksum_finish(ctx, tail, tail_len, out);
+        checksum_reset(ctx);
+    }
+    cache_match_end(m, out);
+}
+
+
+// Per-connection payload staging buffer, allocated once and reused for every
+// request. Only payload bytes are received into it and each request starts
+// at offset 0, so every full block lies contiguous at a 4096-byte aligned
+// offset and checksum_update reads it in place.
+struct payload_ring {
+    uint8_t *data;
+    size_t head;    // next byte to hash
+    size_t tail;    // next byte to receive into
+};
+
+int ring_init(struct payload_ring *ring)
+{
+    ring->head = ring->tail = 0;
+    return stats_posix_memalign((void **)&ring->data, UPDATE_PAYLOAD_SIZE, RING_SIZE);
+}
+
+void ring_reset(struct payload_ring *ring)
+{
+    ring->head = ring->tail = 0;
+}
+
+uint8_t *ring_head(struct payload_ring *ring)
+{
+    return ring->data + ring->head % RING_SIZE;
+}
+
+uint8_t *ring_tail(struct payload_ring *ring)
+{
+    return ring->data + ring->tail % RING_SIZE;
+}
+
+size_t ring_pending(const struct payload_ring *ring)
+{
+    return ring->tail - ring->head;
+}
+
+// Contiguous room at the tail, capped at the payload bytes still expected
+size_t ring_space(const struct payload_ring *ring, size_t remaining)
+{
+    size_t space = RING_SIZE - ring->tail % RING_SIZE;
+    if(space > RING_SIZE - ring_pending(ring)) space = RING_SIZE - ring_pending(ring);
+    if(space > remaining) space = remaining;
+    return space;
+}
+
+// Hash every complete block. The tail (less than a block) is left for checksum_finish
+void ring_consume(struct payload_ring *ring, struct checksum_ctx *ctx)
+{
+    while(ring_pending(ring) >= UPDATE_PAYLOAD_SIZE){
+        checksum_update(ctx, ring_head(ring));
+        ring->head += UPDATE_PAYLOAD_SIZE;
+    }
+}
+
+
+// A HashResponse exactly as it goes on the wire, so it leaves in one write
+struct hash_response {
+    uint32_t type;
+    uint32_t counter;
+    uint8_t checksum[32];
+};
+
+// Each connection served by the epoll loop reads the Initialization once and
+// then loops HEADER -> PAYLOAD for every HashRequest the client announced.
+// The Acknowledgement and HashResponses are queued rather than written
+// inline, so the loop keeps reading pipelined requests and flushes every
+// response a connection produced in one iteration with a single sendmsg.
+enum conn_state {
+    CONN_INIT,      // reading the Initialization (type, N)
+    CONN_HEADER,    // reading a HashRequest header (type, length)
+    CONN_PAYLOAD,   // streaming the payload into the checksum
+    CONN_DONE,      // all N answered, close once the output queue drains
+};
+
+struct connection {
+    int fd;
+    enum conn_state state;
+    uint32_t events;            // epoll interest currently registered
+    struct checksum_ctx *ctx;
+
+    uint32_t hashreq_num;       // HashRequests announced in the Initialization
+    uint32_t counter;           // HashRequest currently being served
+    uint32_t remaining;         // payload bytes still to be received
+    uint32_t length;            // of the current payload
+
+    uint8_t hdr[8];
+    size_t hdr_len;
+    struct payload_ring ring;
+    struct cache_match match;   // of the current payload against the result cache
+
+    uint8_t out[OUT_QUEUE_SIZE]; // queued Acknowledgement/HashResponses
+    size_t out_head;            // next byte to send
+    size_t out_tail;            // next byte to queue
+
+    int failed;
+    int touched;                // on the event loop's flush list
+    int hash_queued;            // on the event loop's hash list
+    struct connection *flush_next;
+    struct connection *hash_next;
+    struct connection *next;    // free list link
+};
+
+struct event_loop {
+    int epfd;
+    int listen_fd;
+    const struct server_arguments *args;
+    struct connection *free_conns; // closed connections kept for reuse
+    struct connection *flush_list; // connections that saw events this iteration
+    struct connection *hash_list;  // connections with full blocks waiting to be hashed
+};
+
+
+int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+// Non-blocking counterpart of read_data: receive until *done reaches
+// expected. Returns 1 when complete, 0 when the socket would block and -1
+// on EOF or error.
+int recv_some(int fd, uint8_t *buffer, size_t *done, size_t expected)
+{
+    while(*done < expected){
+        stats_count_syscall();
+        ssize_t n = recv(fd, buffer + *done, expected - *done, 0);
+        if(n > 0){
+            *done += n;
+        }else if(n == 0){
+            return -1;
+        }else if(errno == EAGAIN || errno == EWOULDBLOCK){
+            return 0;
+        }else if(errno != EINTR){
+            return -1;
+        }
+    }
+    return 1;
+}
+
+
+struct connection *conn_alloc(const struct server_arguments *args)
+{
+    struct connection *conn = stats_calloc(1, sizeof(*conn));
+    if(!conn) return NULL;
+    conn->ctx = create_checksum(args);
+    if(!conn->ctx){
+        stats_free(conn);
+        return NULL;
+    }
+    if(ring_init(&conn->ring) != 0){
+        checksum_destroy(conn->ctx);
+        stats_free(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+struct connection *conn_open(struct event_loop *loop, int fd)
+{
+    struct connection *conn = loop->free_conns;
+    if(conn){
+        loop->free_conns = conn->next;
+    }else if(!(conn = conn_alloc(loop->args))){
+        return NULL;
+    }
+
+    conn->fd = fd;
+    conn->state = CONN_INIT;
+    conn->events = EPOLLIN;
+    conn->hashreq_num = 0;
+    conn->counter = 0;
+    conn->remaining = 0;
+    conn->hdr_len = 0;
+    conn->length = 0;
+    ring_reset(&conn->ring);
+    conn->out_head = 0;
+    conn->out_tail = 0;
+    conn->failed = 0;
+    conn->touched = 0;
+    conn->hash_queued = 0;
+    conn->flush_next = NULL;
+    conn->hash_next = NULL;
+    conn->next = NULL;
+    return conn;
+}
+
+void conn_close(struct event_loop *loop, struct connection *conn)
+{
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+
+    // A client may hang up in the middle of a payload
+    checksum_reset(conn->ctx);
+    cache_match_end(&conn->match, NULL);
+    conn->next = loop->free_conns;
+    loop->free_conns = conn;
+}
+
+
+size_t outq_pending(const struct connection *conn)
+{
+    return conn->out_tail - conn->out_head;
+}
+
+void outq_push(struct connection *conn, const void *data, size_t len)
+{
+    size_t off = conn->out_tail % OUT_QUEUE_SIZE;
+    size_t first = OUT_QUEUE_SIZE - off;
+    if(first > len) first = len;
+
+    memcpy(conn->out + off, data, first);
+    memcpy(conn->out, (const uint8_t *)data + first, len - first);
+    conn->out_tail += len;
+}
+
+// Send everything queued, in at most two iovecs when the queue has wrapped.
+// Returns -1 on error, 0 otherwise (even if the socket is full).
+int conn_flush(struct connection *conn)
+{
+    while(outq_pending(conn) > 0){
+        size_t off = conn->out_head % OUT_QUEUE_SIZE;
+        size_t first = OUT_QUEUE_SIZE - off;
+        if(first > outq_pending(conn)) first = outq_pending(conn);
+
+        struct iovec iov[2];
+        iov[0].iov_base = conn->out + off;
+        iov[0].iov_len = first;
+        iov[1].iov_base = conn->out;
+        iov[1].iov_len = outq_pending(conn) - first;
+
+        struct msghdr msg;
+        bzero(&msg, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov[1].iov_len ? 2 : 1;
+
+        stats_count_syscall();
+        ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if(n >= 0){
+            conn->out_head += n;
+        }else if(errno == EAGAIN || errno == EWOULDBLOCK){
+            return 0;
+        }else if(errno != EINTR){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void queue_hash(struct event_loop *loop, struct connection *conn)
+{
+    if(conn->hash_queued || ring_pending(&conn->ring) < UPDATE_PAYLOAD_SIZE) return;
+    conn->hash_queued = 1;
+    conn->hash_next = loop->hash_list;
+    loop->hash_list = conn;
+}
+
+// Drive the connection's state machine as far as the socket and the output
+// queue allow. Returns 0 when it is waiting, -1 on EOF or error.
+int conn_advance(struct event_loop *loop, struct connection *conn)
+{
+    int rc;
+    struct hash_response resp;
+
+    while(1){
+        switch(conn->state){
+        case CONN_INIT:
+            if((rc = recv_some(conn->fd, conn->hdr, &conn->hdr_len, 8)) <= 0) return rc ? -1 : 0;
+            memcpy(&conn->hashreq_num, conn->hdr + 4, 4);
+            conn->hashreq_num = ntohl(conn->hashreq_num);
+            fprintf(stderr, "Server will get %d hash Requests\n", conn->hashreq_num);
+
+            // Acknowledgement echoes N back
+            resp.type = htonl(2);
+            memcpy(&resp.counter, conn->hdr + 4, 4);
+            outq_push(conn, &resp, 8);
+
+            conn->hdr_len = 0;
+            conn->state = conn->hashreq_num ? CONN_HEADER : CONN_DONE;
+            break;
+
+        case CONN_HEADER:
+            // Stop reading while there is no room left to queue the answer
+            if(OUT_QUEUE_SIZE - outq_pending(conn) < sizeof(resp)) return 0;
+            if((rc = recv_some(conn->fd, conn->hdr, &conn->hdr_len, 8)) <= 0) return rc ? -1 : 0;
+            memcpy(&conn->length, conn->hdr + 4, 4);
+            conn->remaining = conn->length = ntohl(conn->length);
+            ring_reset(&conn->ring);
+            match_begin(&conn->match, loop->args, conn->length);
+            conn->state = CONN_PAYLOAD;
+            break;
+
+        case CONN_PAYLOAD:
+            // Hash each recv's worth straight out of the ring's first bytes
+            if(loop->args->stream){
+                while(conn->remaining > 0){
+                    size_t done = 0;
+                    rc = recv_some(conn->fd, conn->ring.data, &done, conn->remaining < RING_SIZE ? conn->remaining : RING_SIZE);
+                    if(!match_payload(&conn->match, conn->ctx, conn->ring.data, done, conn->length - conn->remaining)){
+                        checksum_update_bytes(conn->ctx, conn->ring.data, done);
+                    }
+                    conn->remaining -= done;
+                    if(rc <= 0) return rc ? -1 : 0;
+                }
+                finish_payload(&conn->match, conn->ctx, NULL, 0, resp.checksum);
+                goto respond;
+            }
+
+            // Full blocks stay in the ring until hash_pending() hashes them
+            // together with other connections' blocks
+            while(conn->remaining > 0){
+                size_t space = ring_space(&conn->ring, conn->remaining);
+                if(space == 0) break;
+
+                size_t done = 0;
+                uint8_t *at = ring_tail(&conn->ring);
+                rc = recv_some(conn->fd, at, &done, space);
+                conn->ring.tail += done;
+                conn->remaining -= done;
+                if(match_payload(&conn->match, conn->ctx, at, done, conn->ring.head)){
+                    // The cached copy has these bytes; only a partial block stays
+                    conn->ring.head = conn->ring.tail - conn->ring.tail % UPDATE_PAYLOAD_SIZE;
+                }
+                if(rc <= 0){
+                    queue_hash(loop, conn);
+                    return rc ? -1 : 0;
+                }
+            }
+            if(ring_pending(&conn->ring) >= UPDATE_PAYLOAD_SIZE){
+                queue_hash(loop, conn);
+                return 0;
+            }
+
+            finish_payload(&conn->match, conn->ctx, ring_head(&conn->ring), ring_pending(&conn->ring), resp.checksum);
+        respond:
+            stats_count_request();
+
+            resp.type = htonl(4);
+            resp.counter = htonl(conn->counter);
+            outq_push(conn, &resp, sizeof(resp));
+
+            conn->hdr_len = 0;
+            conn->state = ++conn->counter == conn->hashreq_num ? CONN_DONE : CONN_HEADER;
+            break;
+
+        case CONN_DONE:
+            return 0;
+        }
+    }
+}
+
+// Register for reads while the state machine can make progress and for
+// writes while responses are stuck in the output queue
+void conn_watch(struct event_loop *loop, struct connection *conn)
+{
+    uint32_t events = 0;
+    if(conn->state != CONN_DONE && (conn->state != CONN_HEADER || OUT_QUEUE_SIZE - outq_pending(conn) >= sizeof(struct hash_response))){
+        events |= EPOLLIN;
+    }
+    if(outq_pending(conn) > 0){
+        events |= EPOLLOUT;
+    }
+    if(events == conn->events) return;
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = conn;
+    stats_count_syscall();
+    epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+    conn->events = events;
+}
+
+// Hash the full blocks received this iteration. Each round takes one block
+// from every queued connection and hashes them side by side with
+// checksum_update_many. Connections whose rings were full or that were
+// waiting on their last blocks to finish a payload are advanced again,
+// which may queue more blocks.
+void hash_pending(struct event_loop *loop)
+{
+    struct checksum_ctx *ctx[MAX_HASH_BATCH];
+    const uint8_t *blocks[MAX_HASH_BATCH];
+
+    while(loop->hash_list){
+        struct connection *list = loop->hash_list;
+        loop->hash_list = NULL;
+
+        for(struct connection *conn = list; conn; ){
+            size_t n = 0;
+            for(; conn && n < MAX_HASH_BATCH; conn = conn->hash_next, n++){
+                ctx[n] = conn->ctx;
+                blocks[n] = ring_head(&conn->ring);
+            }
+            checksum_update_many(ctx, blocks, n);
+        }
+
+        while(list){
+            struct connection *conn = list;
+            list = conn->hash_next;
+            conn->hash_queued = 0;
+            conn->ring.head += UPDATE_PAYLOAD_SIZE;
+
+            if(ring_pending(&conn->ring) >= UPDATE_PAYLOAD_SIZE){
+                queue_hash(loop, conn);
+            }else if(!conn->failed && conn_advance(loop, conn) < 0){
+                conn->failed = 1;
+            }
+        }
+    }
+}
+
+// Flush every connection that saw an event this iteration, then close the
+// ones that failed or have answered everything
+void flush_connections(struct event_loop *loop)
+{
+    struct connection *conn = loop->flush_list;
+    loop->flush_list = NULL;
+
+    while(conn){
+        struct connection *next = conn->flush_next;
+        conn->touched = 0;
+
+        if(!conn->failed && conn_flush(conn) < 0){
+            conn->failed = 1;
+        }
+        if(conn->failed || (conn->state == CONN_DONE && outq_pending(conn) == 0)){
+            conn_close(loop, conn);
+        }else{
+            conn_watch(loop, conn);
+        }
+        conn = next;
+    }
+}
+
+void accept_clients(struct event_loop *loop)
+{
+    while(1){
+        struct sockaddr_in client_addr;
+        socklen_t addrlen = sizeof(client_addr);
+        int client_socket = accept(loop->listen_fd, (struct sockaddr*)&client_addr, &addrlen);
+        if(client_socket < 0){
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                fprintf(stderr, "accept() failed\n");
+            }
+            return;
+        }
+
+        struct connection *conn;
+        if(set_nonblocking(client_socket) < 0 || !(conn = conn_open(loop, client_socket))){
+            fprintf(stderr, "Error setting up client connection\n");
+            close(client_socket);
+            continue;
+        }
+
+        struct epoll_event ev;
+        ev.events = conn->events;
+        ev.data.ptr = conn;
+        if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, client_socket, &ev) < 0){
+            fprintf(stderr, "epoll_ctl() failed\n");
+            conn_close(loop, conn);
+        }
+    }
+}
+
+// Serve every client concurrently. The listening socket is registered with
+// a NULL data pointer, client sockets with their connection.
+void run_event_loop(int sockfd, const struct server_arguments *args)
+{
+    struct event_loop loop;
+    bzero(&loop, sizeof(loop));
+    loop.listen_fd = sockfd;
+    loop.args = args;
+
+    // Each loop owns its contexts, so workers never contend on the allocator
+    // or share hashing state
+    for(int i = 0; i < CONN_POOL_SIZE; i++){
+        struct connection *conn = conn_alloc(args);
+        if(!conn){
+            fprintf(stderr, "Error creating checksum\n");
+            exit(EXIT_FAILURE);
+        }
+        conn->next = loop.free_conns;
+        loop.free_conns = conn;
+    }
 
+    if((loop.epfd = epoll_create1(0)) < 0 || set_nonblocking(sockfd) < 0){
+        fprintf(stderr, "epoll setup failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if(epoll_ctl(loop.epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0){
+        fprintf(stderr, "epoll_ctl() failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while(1){
+        stats_count_syscall();
+        int ready = epoll_wait(loop.epfd, events, MAX_EPOLL_EVENTS, -1);
+        if(ready < 0){
+            if(errno == EINTR) continue;
+            fprintf(stderr, "epoll_wait() failed\n");
+            exit(EXIT_FAILURE);
+        }
+
+        for(int i = 0; i < ready; i++){
+            struct connection *conn = events[i].data.ptr;
+            if(!conn){
+                accept_clients(&loop);
+                continue;
+            }
+
+            if(!conn->touched){
+                conn->touched = 1;
+                conn->flush_next = loop.flush_list;
+                loop.flush_list = conn;
+            }
+            if((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && conn_advance(&loop, conn) < 0){
+                conn->failed = 1;
+            }
+        }
+        hash_pending(&loop);
+        flush_connections(&loop);
+    }
+}
+
+// Steps 1-3 of main. Worker threads each open their own listener on the
+// same port with SO_REUSEPORT so the kernel spreads connections over them.
+int open_listener(const struct server_arguments *args, int reuseport)
+{
     // 1. Create a TCP socket
     int sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if(sockfd < 0) {
         fprintf(stderr, "Server Socket Failed\n");
-        exit(EXIT_FAILURE);
+        return -1;
+    }
+
+    int on = 1;
+    if(reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        fprintf(stderr, "SO_REUSEPORT Failed\n");
+        close(sockfd);
+        return -1;
     }
 
     struct sockaddr_in address;
     bzero(&address, sizeof(address));
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = htonl(INADDR_ANY);
-    address.sin_port = htons(args.port);
+    address.sin_port = htons(args->port);
 
     // 2. Bind socket to a port
-    //printf("%d\n",args.port);
+    //printf("%d\n",args->port);
     int sockbind = bind(sockfd, (struct sockaddr*)&address, sizeof(address));
     if(sockbind < 0) {
         fprintf(stderr, "Bind Failed\n");
-        exit(EXIT_FAILURE);
+        close(sockfd);
+        return -1;
     }
 
     // 3. Set socket to listen
-    if(listen(sockfd, MAX_CLIENT_QUEUE) < 0) {
+    if(listen(sockfd, (args->epoll || args->threads) ? SOMAXCONN : MAX_CLIENT_QUEUE) < 0) {
         fprintf(stderr, "Listen Failed\n");
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+struct worker {
+    pthread_t tid;
+    int listen_fd;
+    const struct server_arguments *args;
+};
+
+void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    run_event_loop(w->listen_fd, w->args);
+    return NULL;
+}
+
+// Run args->threads independent event loops, one per SO_REUSEPORT listener.
+// Workers share nothing but the read-only arguments.
+void run_workers(const struct server_arguments *args)
+{
+    struct worker *workers = stats_calloc(args->threads, sizeof(*workers));
+    if(!workers){
+        fprintf(stderr, "Error allocating workers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for(int i = 0; i < args->threads; i++){
+        workers[i].args = args;
+        if((workers[i].listen_fd = open_listener(args, 1)) < 0){
+            exit(EXIT_FAILURE);
+        }
+        if(pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]) != 0){
+            fprintf(stderr, "pthread_create() failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    fprintf(stderr, "Serving with %d worker threads\n", args->threads);
+
+    for(int i = 0; i < args->threads; i++){
+        pthread_join(workers[i].tid, NULL);
+    }
+    if(args->cache) cache_destroy(args->cache);
+    exit(EXIT_SUCCESS);
+}
+
+
+struct bench_worker {
+    pthread_t tid;
+    const struct server_arguments *args;
+    const uint8_t *payload;
+    _Atomic int *stop;
+    uint64_t bytes;
+};
+
+// Hash BENCH_PAYLOAD_SIZE-byte requests the way a connection would until told to stop
+void *bench_main(void *arg)
+{
+    struct bench_worker *w = arg;
+    struct checksum_ctx *ctx = create_checksum(w->args);
+    uint8_t checksum[32];
+
+    if(!ctx){
+        fprintf(stderr, "Error creating checksum\n");
+        return NULL;
+    }
+    while(!atomic_load(w->stop)){
+        size_t off;
+        for(off = 0; off + UPDATE_PAYLOAD_SIZE < BENCH_PAYLOAD_SIZE; off += UPDATE_PAYLOAD_SIZE){
+            checksum_update(ctx, w->payload + off);
+        }
+        checksum_finish(ctx, w->payload + off, BENCH_PAYLOAD_SIZE - off, checksum);
+        checksum_reset(ctx);
+        w->bytes += BENCH_PAYLOAD_SIZE;
+    }
+    checksum_destroy(ctx);
+    return NULL;
+}
+
+// Report MB/s hashed with 1 up to all online cores hashing in parallel
+void run_benchmark(const struct server_arguments *args)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cores < 1) cores = 1;
+
+    uint8_t *payload = stats_malloc(BENCH_PAYLOAD_SIZE);
+    struct bench_worker *workers = stats_calloc(cores, sizeof(*workers));
+    if(!payload || !workers){
+        fprintf(stderr, "Error allocating benchmark buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    for(size_t i = 0; i < BENCH_PAYLOAD_SIZE; i++){
+        payload[i] = rand();
+    }
+
+    printf("threads,MB/s\n");
+    for(long n = 1; n <= cores; n++){
+        _Atomic int stop;
+        struct timespec start, end;
+
+        atomic_init(&stop, 0);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(long i = 0; i < n; i++){
+            workers[i].args = args;
+            workers[i].payload = payload;
+            workers[i].stop = &stop;
+            workers[i].bytes = 0;
+            pthread_create(&workers[i].tid, NULL, bench_main, &workers[i]);
+        }
+        sleep(BENCH_SECONDS);
+        atomic_store(&stop, 1);
+
+        uint64_t total = 0;
+        for(long i = 0; i < n; i++){
+            pthread_join(workers[i].tid, NULL);
+            total += workers[i].bytes;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%ld,%.1f\n", n, total / elapsed / 1e6);
+        fflush(stdout);
+    }
+
+    stats_free(workers);
+    stats_free(payload);
+}
+
+int main(int argc, char *argv[])
+{
+    // 1. Create a TCP socket
+    // 2. Bind socket to a port
+    // 3. Set socket to listen
+    // 4. Repeatedly:
+    //  a. Accept new connection
+    //  b. Communicate
+    //  c. Close the connection
+    struct server_arguments args;
+
+    //printf("I am the server.\n");
+
+    server_parseopt(&args, argc, argv);
+
+    // kill -USR1 dumps the allocation counters
+    if(stats_start_dump_thread(stderr) != 0){
+        fprintf(stderr, "Error starting stats thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(args.cache_mb){
+        args.cache = cache_create((uint8_t *)args.salt, args.salt_len, args.cache_mb << 20);
+        if(!args.cache){
+            fprintf(stderr, "Error creating result cache\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(args.bench){
+        run_benchmark(&args);
+        if(args.cache) cache_destroy(args.cache);
+        return 0;
+    }
+
+    if(args.threads){
+        run_workers(&args);
+    }
+
+    // 1-3. Create, bind and listen
+    int sockfd = open_listener(&args, 0);
+    if(sockfd < 0) {
         exit(EXIT_FAILURE);
     }
 
@@ -148,6 +952,24 @@ int main(int argc, char *argv[])
     //char buffer[1024] = {0};
     //char* hello = "Hello from server";
 
+    if(args.epoll){
+        run_event_loop(sockfd, &args);
+    }
+
+    // One context and payload buffer, reused for every client
+    struct checksum_ctx *ctx = create_checksum(&args);
+    if (!ctx) {
+        fprintf(stderr, "Error creating checksum\n");
+        return 0;
+    }
+
+    struct payload_ring ring;
+    struct cache_match match;
+    if(ring_init(&ring) != 0) {
+        fprintf(stderr, "Error allocating payload buffer\n");
+        exit(EXIT_FAILURE);
+    }
+
     while(1){
 
         // Add client
@@ -155,7 +977,8 @@ int main(int argc, char *argv[])
         socklen_t addrlen = sizeof(client_addr);
         int client_socket;
 
-        if ((client_socket  = accept(sockfd, (struct sockaddr*)&client_addr, &addrlen))  < 0) {
+        client_socket = accept(sockfd, (struct sockaddr*)&client_addr, &addrlen);
+        if (client_socket < 0) {
                 //perror("accept failed");
                 fprintf(stderr, "accept() failed\n");
                 //exit(EXIT_FAILURE);
@@ -166,80 +989,85 @@ int main(int argc, char *argv[])
 
             // Receive Initialization
 
-            uint32_t type;
-            read_data(&type, 4, client_socket);
-            uint32_t hashreq_num;
-            read_data(&hashreq_num, 4, client_socket);;
+            uint32_t init[2];
+            read_data(init, 8, client_socket);
+            uint32_t hashreq_num = init[1];
             fprintf(stderr, "Server will get %d hash Requests\n", ntohl(hashreq_num));
 
 
 
             // Send  Acknowledgement
-            uint32_t type_nb = htonl(2);
-            send_data(&type_nb, 4, client_socket);
-            send_data(&hashreq_num, 4, client_socket);
+            uint32_t ack[2] = { htonl(2), hashreq_num };
+            send_data(ack, 8, client_socket);
 
 
             uint32_t counter;
             uint32_t mes_length;
-            struct checksum_ctx *ctx;
-            if(args.salt_len == 0){
-                ctx = checksum_create(NULL, 0);
-            }else{
-                ctx = checksum_create(((uint8_t *)args.salt), sizeof(args.salt)-1);
-            }
-
-            if (!ctx) {
-                fprintf(stderr, "Error creating checksum\n");
-                return 0;
-            }
             
             
  
             for(counter = 0; counter < htonl(hashreq_num); counter++){
                 //Hash request
-                read_data(&type, 4, client_socket);
-                read_data(&mes_length, 4, client_socket);
-                mes_length = ntohl(mes_length);
-
-                void *read_buffer = NULL;
-                int update_times= 0;
-                if(mes_length <= UPDATE_PAYLOAD_SIZE){
-                    read_buffer = calloc(1, mes_length);
-                    read_data(read_buffer, mes_length, client_socket);
-                }else{
-                    read_buffer = calloc(1, UPDATE_PAYLOAD_SIZE);
-                    int remainder = mes_length % UPDATE_PAYLOAD_SIZE;
-                    update_times = (mes_length-remainder)/UPDATE_PAYLOAD_SIZE;
-                    for(int i = 0; i < update_times; i++){
-                        read_data(read_buffer, UPDATE_PAYLOAD_SIZE, client_socket);
-                        checksum_update(ctx, read_buffer);
+                uint32_t header[2];
+                read_data(header, 8, client_socket);
+                mes_length = ntohl(header[1]);
+
+                struct hash_response resp;
+                match_begin(&match, &args, mes_length);
+
+                if(args.stream){
+                    // Hash each recv's worth as it lands, partial blocks included
+                    uint32_t remaining = mes_length;
+                    while(remaining > 0){
+                        ssize_t n = read_some(ring.data, remaining < RING_SIZE ? remaining : RING_SIZE, client_socket);
+                        if(n <= 0) break;
+                        if(!match_payload(&match, ctx, ring.data, n, mes_length - remaining)){
+                            checksum_update_bytes(ctx, ring.data, n);
+                        }
+                        remaining -= n;
                     }
-                    free(read_buffer);
-                    read_buffer = calloc(1,remainder);
-                    read_data(read_buffer, remainder, client_socket);
+                    if(remaining > 0){
+                        fprintf(stderr, "Client disconnected mid-payload\n");
+                        checksum_reset(ctx);
+                        cache_match_end(&match, NULL);
+                        break;
+                    }
+                    finish_payload(&match, ctx, NULL, 0, resp.checksum);
+                    goto respond;
                 }
-                
-                uint8_t checksum[32];
-                checksum_finish(ctx, read_buffer, mes_length-UPDATE_PAYLOAD_SIZE*update_times, checksum);
-                checksum_reset(ctx);
 
-                //Hash response
-                uint32_t counter_nb = htonl(counter);
-                type_nb = htonl(4);
-                send_data(&type_nb, 4, client_socket);
-                send_data(&counter_nb, 4, client_socket);
-                send_data(checksum, 32, client_socket);
+                ring_reset(&ring);
+                uint32_t remaining = mes_length;
+                while(remaining > 0){
+                    size_t chunk = ring_space(&ring, remaining);
+                    uint8_t *at = ring_tail(&ring);
+                    read_data(at, chunk, client_socket);
+                    ring.tail += chunk;
+                    remaining -= chunk;
+                    if(match_payload(&match, ctx, at, chunk, ring.head)){
+                        ring.head = ring.tail - ring.tail % UPDATE_PAYLOAD_SIZE;
+                    }
+                    ring_consume(&ring, ctx);
+                }
 
-                free(read_buffer);
+                finish_payload(&match, ctx, ring_head(&ring), ring_pending(&ring), resp.checksum);
+            respond:
+                stats_count_request();
+
+                //Hash response
+                resp.type = htonl(4);
+                resp.counter = htonl(counter);
+                send_data(&resp, sizeof(resp), client_socket);
             }
              
-            checksum_destroy(ctx);
              close(client_socket);     
          
         
     }
 
+    checksum_destroy(ctx);
+    stats_free(ring.data);
+    if(args.cache) cache_destroy(args.cache);
     close(sockfd);
 
     return 0;
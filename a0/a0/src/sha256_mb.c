@@ -0,0 +1,190 @@
+#include <string.h>
+#include <immintrin.h>
+
+#include "sha256_mb.h"
+
+/* Both kernels are compiled for their ISA with target pragmas, so the rest
+ * of the program keeps building for the baseline architecture. */
+
+static const uint32_t K256[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+#define ROR8(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+#define XOR8(x, y, z) _mm256_xor_si256(_mm256_xor_si256((x), (y)), (z))
+#define ADD8(x, y) _mm256_add_epi32((x), (y))
+
+/* Load 32 bytes from each of 8 lanes and transpose, so that out[w] holds
+ * big-endian word w of every lane. */
+static inline void load_words_x8(__m256i out[8], const uint8_t *p[8], size_t off) {
+	const __m256i bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+	                                      12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	__m256i r[8], t[8], u[8];
+
+	for (int i = 0; i < 8; i++) {
+		r[i] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(p[i] + off)), bswap);
+	}
+	for (int i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+	for (int i = 0; i < 8; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (int i = 0; i < 4; i++) {
+		out[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+		out[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+	}
+}
+
+static inline void compress_x8(__m256i s[8], const __m256i m[16]) {
+	__m256i w[16];
+	__m256i a = s[0], b = s[1], c = s[2], d = s[3];
+	__m256i e = s[4], f = s[5], g = s[6], h = s[7];
+
+	memcpy(w, m, sizeof(w));
+	for (int t = 0; t < 64; t++) {
+		if (t >= 16) {
+			__m256i w15 = w[(t - 15) & 15], w2 = w[(t - 2) & 15];
+			__m256i s0 = XOR8(ROR8(w15, 7), ROR8(w15, 18), _mm256_srli_epi32(w15, 3));
+			__m256i s1 = XOR8(ROR8(w2, 17), ROR8(w2, 19), _mm256_srli_epi32(w2, 10));
+			w[t & 15] = ADD8(ADD8(w[t & 15], s0), ADD8(w[(t - 7) & 15], s1));
+		}
+		__m256i ch = _mm256_xor_si256(g, _mm256_and_si256(e, _mm256_xor_si256(f, g)));
+		__m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+		__m256i t1 = ADD8(ADD8(h, XOR8(ROR8(e, 6), ROR8(e, 11), ROR8(e, 25))),
+		                  ADD8(ADD8(ch, _mm256_set1_epi32(K256[t])), w[t & 15]));
+		__m256i t2 = ADD8(XOR8(ROR8(a, 2), ROR8(a, 13), ROR8(a, 22)), maj);
+		h = g; g = f; f = e; e = ADD8(d, t1);
+		d = c; c = b; b = a; a = ADD8(t1, t2);
+	}
+
+	s[0] = ADD8(s[0], a); s[1] = ADD8(s[1], b); s[2] = ADD8(s[2], c); s[3] = ADD8(s[3], d);
+	s[4] = ADD8(s[4], e); s[5] = ADD8(s[5], f); s[6] = ADD8(s[6], g); s[7] = ADD8(s[7], h);
+}
+
+void sha256_x8_avx2(uint32_t *state[8], const uint8_t *first[8],
+                    const uint8_t *rest[8], size_t nblocks) {
+	__m256i s[8], m[16];
+	uint32_t lanes[8][8];
+	const uint8_t *p[8];
+
+	for (int w = 0; w < 8; w++) {
+		s[w] = _mm256_set_epi32(state[7][w], state[6][w], state[5][w], state[4][w],
+		                        state[3][w], state[2][w], state[1][w], state[0][w]);
+	}
+
+	for (size_t j = 0; j < nblocks; j++) {
+		for (int i = 0; i < 8; i++) {
+			p[i] = j ? rest[i] + 64 * (j - 1) : first[i];
+		}
+		load_words_x8(m, p, 0);
+		load_words_x8(m + 8, p, 32);
+		compress_x8(s, m);
+	}
+
+	for (int w = 0; w < 8; w++) {
+		_mm256_storeu_si256((__m256i *)lanes[w], s[w]);
+	}
+	for (int i = 0; i < 8; i++) {
+		for (int w = 0; w < 8; w++) {
+			state[i][w] = lanes[w][i];
+		}
+	}
+}
+
+#pragma GCC pop_options
+
+
+#pragma GCC push_options
+#pragma GCC target("avx2,avx512f")
+
+#define ROR16(x, n) _mm512_ror_epi32((x), (n))
+#define XOR16(x, y, z) _mm512_ternarylogic_epi32((x), (y), (z), 0x96)
+#define ADD16(x, y) _mm512_add_epi32((x), (y))
+
+/* Same transposed load as above for 16 lanes: two 8-lane transposes glued
+ * into the low and high halves */
+static inline void load_words_x16(__m512i out[8], const uint8_t *p[16], size_t off) {
+	__m256i lo[8], hi[8];
+
+	load_words_x8(lo, p, off);
+	load_words_x8(hi, p + 8, off);
+	for (int i = 0; i < 8; i++) {
+		out[i] = _mm512_inserti64x4(_mm512_castsi256_si512(lo[i]), hi[i], 1);
+	}
+}
+
+static inline void compress_x16(__m512i s[8], const __m512i m[16]) {
+	__m512i w[16];
+	__m512i a = s[0], b = s[1], c = s[2], d = s[3];
+	__m512i e = s[4], f = s[5], g = s[6], h = s[7];
+
+	memcpy(w, m, sizeof(w));
+	for (int t = 0; t < 64; t++) {
+		if (t >= 16) {
+			__m512i w15 = w[(t - 15) & 15], w2 = w[(t - 2) & 15];
+			__m512i s0 = XOR16(ROR16(w15, 7), ROR16(w15, 18), _mm512_srli_epi32(w15, 3));
+			__m512i s1 = XOR16(ROR16(w2, 17), ROR16(w2, 19), _mm512_srli_epi32(w2, 10));
+			w[t & 15] = ADD16(ADD16(w[t & 15], s0), ADD16(w[(t - 7) & 15], s1));
+		}
+		__m512i ch = _mm512_ternarylogic_epi32(e, f, g, 0xCA);
+		__m512i maj = _mm512_ternarylogic_epi32(a, b, c, 0xE8);
+		__m512i t1 = ADD16(ADD16(h, XOR16(ROR16(e, 6), ROR16(e, 11), ROR16(e, 25))),
+		                   ADD16(ADD16(ch, _mm512_set1_epi32(K256[t])), w[t & 15]));
+		__m512i t2 = ADD16(XOR16(ROR16(a, 2), ROR16(a, 13), ROR16(a, 22)), maj);
+		h = g; g = f; f = e; e = ADD16(d, t1);
+		d = c; c = b; b = a; a = ADD16(t1, t2);
+	}
+
+	s[0] = ADD16(s[0], a); s[1] = ADD16(s[1], b); s[2] = ADD16(s[2], c); s[3] = ADD16(s[3], d);
+	s[4] = ADD16(s[4], e); s[5] = ADD16(s[5], f); s[6] = ADD16(s[6], g); s[7] = ADD16(s[7], h);
+}
+
+void sha256_x16_avx512(uint32_t *state[16], const uint8_t *first[16],
+                       const uint8_t *rest[16], size_t nblocks) {
+	__m512i s[8], m[16];
+	uint32_t lanes[8][16];
+	const uint8_t *p[16];
+
+	for (int w = 0; w < 8; w++) {
+		for (int i = 0; i < 16; i++) {
+			lanes[w][i] = state[i][w];
+		}
+		s[w] = _mm512_loadu_si512(lanes[w]);
+	}
+
+	for (size_t j = 0; j < nblocks; j++) {
+		for (int i = 0; i < 16; i++) {
+			p[i] = j ? rest[i] + 64 * (j - 1) : first[i];
+		}
+		load_words_x16(m, p, 0);
+		load_words_x16(m + 8, p, 32);
+		compress_x16(s, m);
+	}
+
+	for (int w = 0; w < 8; w++) {
+		_mm512_storeu_si512(lanes[w], s[w]);
+	}
+	for (int i = 0; i < 16; i++) {
+		for (int w = 0; w < 8; w++) {
+			state[i][w] = lanes[w][i];
+		}
+	}
+}
+
+#pragma GCC pop_options
@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+static struct server_stats counters;
+static struct server_stats last_dump;
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define COUNT(field, n) __atomic_fetch_add(&counters.field, (n), __ATOMIC_RELAXED)
+
+static void count_alloc(size_t size) {
+	COUNT(allocs, 1);
+	COUNT(alloc_bytes, size);
+}
+
+void *stats_malloc(size_t size) {
+	count_alloc(size);
+	return malloc(size);
+}
+
+void *stats_calloc(size_t nmemb, size_t size) {
+	count_alloc(nmemb * size);
+	return calloc(nmemb, size);
+}
+
+void *stats_realloc(void *ptr, size_t size) {
+	count_alloc(size);
+	return realloc(ptr, size);
+}
+
+int stats_posix_memalign(void **memptr, size_t alignment, size_t size) {
+	count_alloc(size);
+	return posix_memalign(memptr, alignment, size);
+}
+
+void stats_free(void *ptr) {
+	if (ptr) {
+		COUNT(frees, 1);
+	}
+	free(ptr);
+}
+
+void stats_count_syscall(void) {
+	COUNT(syscalls, 1);
+}
+
+void stats_count_request(void) {
+	COUNT(requests, 1);
+}
+
+void stats_count_cache(int hit) {
+	if (hit) {
+		COUNT(cache_hits, 1);
+	} else {
+		COUNT(cache_misses, 1);
+	}
+}
+
+void stats_get(struct server_stats *out) {
+	out->allocs = __atomic_load_n(&counters.allocs, __ATOMIC_RELAXED);
+	out->alloc_bytes = __atomic_load_n(&counters.alloc_bytes, __ATOMIC_RELAXED);
+	out->frees = __atomic_load_n(&counters.frees, __ATOMIC_RELAXED);
+	out->syscalls = __atomic_load_n(&counters.syscalls, __ATOMIC_RELAXED);
+	out->requests = __atomic_load_n(&counters.requests, __ATOMIC_RELAXED);
+	out->cache_hits = __atomic_load_n(&counters.cache_hits, __ATOMIC_RELAXED);
+	out->cache_misses = __atomic_load_n(&counters.cache_misses, __ATOMIC_RELAXED);
+}
+
+void stats_dump(FILE *fp) {
+	struct server_stats now;
+
+	pthread_mutex_lock(&dump_lock);
+	stats_get(&now);
+	fprintf(fp, "[stats] allocs %" PRIu64 " (+%" PRIu64 ") bytes %" PRIu64 " (+%" PRIu64 ") frees %" PRIu64 " (+%" PRIu64 ")\n",
+	        now.allocs, now.allocs - last_dump.allocs,
+	        now.alloc_bytes, now.alloc_bytes - last_dump.alloc_bytes,
+	        now.frees, now.frees - last_dump.frees);
+	if (now.requests > last_dump.requests) {
+		fprintf(fp, "[stats] syscalls %" PRIu64 " (+%" PRIu64 ") requests %" PRIu64 " (+%" PRIu64 ") %.2f syscalls/request\n",
+		        now.syscalls, now.syscalls - last_dump.syscalls,
+		        now.requests, now.requests - last_dump.requests,
+		        (double)(now.syscalls - last_dump.syscalls) / (now.requests - last_dump.requests));
+	}
+	if (now.cache_hits + now.cache_misses > 0) {
+		fprintf(fp, "[stats] cache hits %" PRIu64 " (+%" PRIu64 ") misses %" PRIu64 " (+%" PRIu64 ")\n",
+		        now.cache_hits, now.cache_hits - last_dump.cache_hits,
+		        now.cache_misses, now.cache_misses - last_dump.cache_misses);
+	}
+	last_dump = now;
+	pthread_mutex_unlock(&dump_lock);
+}
+
+static void *dump_main(void *arg) {
+	FILE *fp = arg;
+	sigset_t set;
+	int sig;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	while (sigwait(&set, &sig) == 0) {
+		stats_dump(fp);
+	}
+	return NULL;
+}
+
+int stats_start_dump_thread(FILE *fp) {
+	sigset_t set;
+	pthread_t tid;
+
+	/* Blocked here, SIGUSR1 stays blocked in every thread created later
+	 * and is only ever taken by dump_main's sigwait */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+		return -1;
+	}
+	if (pthread_create(&tid, NULL, dump_main, fp) != 0) {
+		return -1;
+	}
+	pthread_detach(tid);
+	return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef CLIENTS_H
+#define CLIENTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#define CLIENT_TIMEOUT 120      // seconds without an update before a client is forgotten
+
+// Binary client address: an IPv6 address, with IPv4 mapped into it as
+// ::ffff:a.b.c.d, and the port. Port 0 marks an empty table slot.
+struct client_key {
+    uint8_t addr[16];
+    uint16_t port;
+};
+
+struct client {
+    struct client_key key;
+    uint32_t stamp;             // seconds from the table's epoch at the last update
+    uint32_t seq;               // highest sequence number seen
+};
+
+_Static_assert(sizeof(struct client) == 28, "client records stay at 28 bytes");
+
+// Clients are stored right in an open-addressed table with linear probing
+// and backward-shift deletion, so a client costs its 28-byte record over
+// the table's load factor (1/2 to 3/4 as it grows by half) and nothing
+// else. Every update sweeps the next few slots for clients past
+// CLIENT_TIMEOUT, and a lookup treats an expired client as new whether or
+// not the sweep has reached it. With a memory cap the table stops growing
+// at the cap and evicts the stalest of a few sampled clients to make
+// room, an approximate LRU.
+struct client_table {
+    struct client *slots;
+    uint32_t size;
+    uint32_t count;
+    uint32_t max_slots;         // from the memory cap
+    uint32_t sweep;             // next slot to look at for expired clients
+    time_t epoch;
+    uint64_t rng;               // picks eviction samples
+    uint64_t evictions;         // live clients forgotten to stay under the cap
+};
+
+// max_bytes caps the table's slot array, 0 for no cap. Returns 0 on
+// success, -1 if the table could not be allocated.
+int client_table_init(struct client_table *table, size_t max_bytes);
+
+void client_key_from(struct client_key *key, const struct sockaddr_storage *addr);
+
+// Record seq from the client at key, as seen at now. Returns 1 if it is
+// older than the highest sequence number the client already sent, and
+// stores that number in *latest; the client's entry is left untouched in
+// that case. Returns 0 otherwise, including for port 0, which is never
+// tracked, or -1 if memory ran out.
+int client_table_update(struct client_table *table, const struct client_key *key,
+                        uint32_t seq, time_t now, uint32_t *latest);
+
+void client_table_free(struct client_table *table);
+
+#endif
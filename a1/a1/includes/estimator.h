@@ -0,0 +1,45 @@
+#ifndef ESTIMATOR_H
+#define ESTIMATOR_H
+
+#define ESTIMATOR_MAX_SAMPLES 64
+#define ESTIMATOR_HISTORY 32    // filtered offsets kept for the drift fit
+
+// NTP-style clock offset estimate from (theta, delta) samples. The last
+// window samples pass through a minimum-delay filter: the sample with the
+// smallest round trip has the least queueing in it, so its theta is the
+// best offset the window has to offer. Each newly selected sample joins a
+// history that a least-squares line is fit through to estimate drift.
+struct offset_sample {
+    double time;                // when the response arrived, local clock
+    double theta;               // offset, server minus client
+    double delta;               // round trip
+};
+
+struct estimator {
+    int window;
+    int count;                  // samples added so far
+    struct offset_sample samples[ESTIMATOR_MAX_SAMPLES];    // ring, count % window
+
+    int history_count;
+    struct offset_sample history[ESTIMATOR_HISTORY];        // ring of selected samples
+    double last_selected;       // time of the sample selected last
+};
+
+struct estimate {
+    double offset;              // filtered offset extrapolated to now
+    double bound;               // offset is within +/- this
+    double drift;               // seconds per second, server relative to client
+    double delay;               // round trip of the selected sample
+    double jitter;              // RMS spread of the window's offsets around it
+    int samples;                // in the window
+};
+
+void estimator_init(struct estimator *e, int window);
+
+void estimator_add(struct estimator *e, double time, double theta, double delta);
+
+// Current estimate at local time now. Returns 0 on success, -1 before the
+// first sample.
+int estimator_get(const struct estimator *e, double now, struct estimate *out);
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef IMPAIR_H
+#define IMPAIR_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define IMPAIR_MAX_PACKET 64
+#define IMPAIR_DEFAULT_LIMIT 1000   // datagrams held back at once, as netem
+
+// netem-style impairments applied to the datagrams a socket sends:
+// Gilbert-Elliott loss, a fixed delay with uniform jitter, duplication and
+// reordering. Delayed datagrams wait in a min-heap keyed on when they are
+// due; the caller flushes it from its own event loop, so nothing here
+// sleeps or needs a thread. Probabilities are fractions in [0, 1].
+struct impair_config {
+    // Gilbert-Elliott: the channel flips between a good and a bad state
+    // and loses datagrams with a different probability in each. Bursts
+    // last 1/ge_r datagrams on average.
+    double ge_p;                // good -> bad, per datagram
+    double ge_r;                // bad -> good, per datagram
+    double loss_bad;            // loss probability in the bad state
+    double loss_good;           // loss probability in the good state
+    double delay;               // seconds
+    double jitter;              // seconds, uniform on +/- jitter around delay
+    double duplicate;           // probability a datagram is sent twice
+    double reorder;             // probability a datagram skips the delay
+    int limit;                  // delayed datagrams beyond this are dropped
+};
+
+struct delayed_packet {
+    uint64_t due;               // CLOCK_MONOTONIC nanoseconds
+    uint64_t order;             // keeps datagrams due together in FIFO order
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    uint16_t len;
+    uint8_t data[IMPAIR_MAX_PACKET];
+};
+
+struct impair {
+    const struct impair_config *config;
+    uint64_t rng;               // xorshift64* state
+    int bad;                    // Gilbert-Elliott state
+    uint64_t order;
+    struct delayed_packet *heap;
+    int count;
+};
+
+// Whether config asks for any impairment at all
+int impair_configured(const struct impair_config *config);
+
+// Returns 0 on success, -1 if the delay queue could not be allocated
+int impair_init(struct impair *im, const struct impair_config *config, uint64_t seed);
+
+// Send len bytes of buf to addr on sock through the impairments, as of
+// now (CLOCK_MONOTONIC nanoseconds). The datagram may be lost, sent once
+// or twice, right away or once a later impair_flush finds it due.
+void impair_sendto(struct impair *im, int sock, const void *buf, size_t len,
+                   const struct sockaddr *addr, socklen_t addr_len, uint64_t now);
+
+// Send every delayed datagram due by now. Returns the nanoseconds until
+// the next one is due, or -1 if none are waiting.
+int64_t impair_flush(struct impair *im, int sock, uint64_t now);
+
+void impair_free(struct impair *im);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#define LIMIT_DEFAULT_SOURCES 65536
+
+// Token buckets as GCRA: a bucket is the single time its next request is
+// due (its theoretical arrival time, TAT), and a request is let through
+// while that is no more than burst - 1 intervals ahead of now. One time is
+// all the state, so every source fits in one 64-bit word: a 20-bit tag
+// from its address hash and its TAT in 16.384 us ticks, good for 9 years.
+// Words are updated with compare-and-swap and searched for within one
+// 64-byte line of 8, so workers share the table without locks. Sources
+// are keyed on address alone; the port is the requester's to pick.
+//
+// The table is approximate by design. Sources whose tags collide share a
+// bucket, and a new source takes the slot of the least-indebted source in
+// its line. A slot whose TAT has passed holds a full bucket, so reusing it
+// changes nothing; only evicting a source still in debt, counted in
+// evictions, forgives it.
+struct limit_config {
+    double source_rate;         // requests per second per source, 0 for no limit
+    double source_burst;
+    double global_rate;         // requests per second overall, 0 for no limit
+    double global_burst;
+    int sources;                // table slots, rounded up to a power of two
+};
+
+struct rate_limiter {
+    _Atomic uint64_t *slots;    // NULL without a per-source limit
+    uint64_t mask;
+    uint64_t interval;          // ticks between a source's requests
+    uint64_t tolerance;         // ticks a source's TAT may run ahead of now
+    uint64_t start;             // CLOCK_MONOTONIC ns of tick 0
+
+    _Atomic uint64_t global_tat;        // ns
+    uint64_t global_interval;           // ns, 0 without a global limit
+    uint64_t global_tolerance;
+
+    _Atomic uint64_t evictions;
+};
+
+enum limit_verdict { LIMIT_PASS, LIMIT_SOURCE, LIMIT_GLOBAL };
+
+// Whether config asks for any limit at all
+int rate_limit_configured(const struct limit_config *config);
+
+// Returns 0 on success, -1 if the table could not be allocated
+int rate_limiter_init(struct rate_limiter *l, const struct limit_config *config, uint64_t now);
+
+// Charge a request from addr arriving at now (CLOCK_MONOTONIC ns) to its
+// source's bucket and then to the global one. A request the global limit
+// turns away is not charged to its source.
+enum limit_verdict rate_limiter_check(struct rate_limiter *l, const struct sockaddr_storage *addr, uint64_t now);
+
+void rate_limiter_free(struct rate_limiter *l);
+
+#endif
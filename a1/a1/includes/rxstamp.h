@@ -0,0 +1,35 @@
+#ifndef RXSTAMP_H
+#define RXSTAMP_H
+
+#include <time.h>
+#include <sys/socket.h>
+
+// Receive timestamps taken by the kernel (or the NIC) when a datagram
+// arrives, delivered as a control message alongside it. They leave out
+// the time a datagram spends queued on the socket and the time before the
+// process is scheduled to read it, both of which a clock_gettime after
+// recvfrom counts as network delay.
+enum rx_stamp_mode {
+    RX_STAMP_NONE,          // clock_gettime(CLOCK_REALTIME) after the receive
+    RX_STAMP_SOFTWARE,      // SO_TIMESTAMPNS: stamped by the kernel on arrival
+    RX_STAMP_HARDWARE,      // SO_TIMESTAMPING: stamped by the NIC where it can
+};
+
+// Room for either control message in a recvmsg control buffer
+#define RX_STAMP_CONTROL_SIZE 128
+
+// Parse none, software or hardware. Returns -1 for anything else.
+int rx_stamp_parse(const char *name);
+
+// Turn on receive stamps of the given kind for sock. Returns 0 on success.
+// Hardware stamps also need the interface's stamping switched on
+// (SIOCSHWTSTAMP, e.g. with hwstamp_ctl) and the NIC clock kept in step
+// with CLOCK_REALTIME (e.g. by phc2sys); datagrams the NIC did not stamp
+// fall back to the kernel's software stamp.
+int rx_stamp_enable(int sock, enum rx_stamp_mode mode);
+
+// Find the receive stamp in a message returned by recvmsg/recvmmsg.
+// Returns 1 and fills ts if there is one, 0 otherwise.
+int rx_stamp_get(struct msghdr *msg, struct timespec *ts);
+
+#endif
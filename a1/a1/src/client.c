@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,9 +12,12 @@
 #include <time.h>
 #include <netdb.h>
 #include <math.h>
+#include <poll.h>
+
+#include "rxstamp.h"
+#include "estimator.h"
+#include "wire.h"
 
-#define SEND_BUFFER_SIZE 24
-#define RECV_BUFFER_SIZE 40
 
 struct client_arguments {
 	char ip_address[16];
@@ -21,6 +25,14 @@ struct client_arguments {
 	int reqnum;
 	int timeout;
     int condensed;
+    enum rx_stamp_mode rx_stamp;
+    int stats;
+    int estimate;
+    double poll;                // seconds between TimeRequests when estimating
+    int samples;                // estimator window
+    int stream;
+    double rate;                // target TimeRequests per second when streaming
+    double max_drop;            // drop percentage that makes streaming back off
 };
 
 typedef struct {
@@ -32,6 +44,7 @@ typedef struct {
 error_t client_parser(int key, char *arg, struct argp_state *state) {
 	struct client_arguments *args = state->input;
 	error_t ret = 0;
+	int mode;
 	switch(key) {
 	case 'a':
 		/* validate that address parameter makes sense */
@@ -58,6 +71,42 @@ error_t client_parser(int key, char *arg, struct argp_state *state) {
     case 'c':
 		args->condensed = 1;
 		break;
+	case 300:
+		if ((mode = rx_stamp_parse(arg)) < 0) {
+			argp_error(state, "Receive stamps must be none, software or hardware");
+		}
+		args->rx_stamp = mode;
+		break;
+	case 301:
+		args->stats = 1;
+		break;
+	case 302:
+		args->estimate = 1;
+		break;
+	case 303:
+		args->poll = atof(arg);
+		if (args->poll <= 0) {
+			argp_error(state, "Poll interval must be positive");
+		}
+		break;
+	case 305:
+		args->stream = 1;
+		break;
+	case 306:
+		args->rate = atof(arg);
+		if (args->rate < 1) {
+			argp_error(state, "Rate must be at least 1 request per second");
+		}
+		break;
+	case 307:
+		args->max_drop = atof(arg);
+		break;
+	case 304:
+		args->samples = atoi(arg);
+		if (args->samples < 1 || args->samples > ESTIMATOR_MAX_SAMPLES) {
+			argp_error(state, "Samples must be between 1 and %d", ESTIMATOR_MAX_SAMPLES);
+		}
+		break;
 	default:
 		ret = ARGP_ERR_UNKNOWN;
 		break;
@@ -68,6 +117,10 @@ error_t client_parser(int key, char *arg, struct argp_state *state) {
 void client_parseopt(struct client_arguments *args,int argc, char *argv[]) {
     
     bzero(args, sizeof(*args));
+	args->poll = 1;
+	args->samples = 8;
+	args->rate = 1000;
+	args->max_drop = 5;
 
 	struct argp_option options[] = {
 		{ "ip_address", 'a', "addr", 0, "The IP address the server is listening at", 0},
@@ -75,6 +128,14 @@ void client_parseopt(struct client_arguments *args,int argc, char *argv[]) {
 		{ "req_num", 'n', "req_num", 0, "The number of TimeRequests (N) that the client will send to the server", 0},
 		{ "timeout", 't', "timeout", 0, " The time in seconds (T) that the client will wait after sending its last TimeRequest to receive a TimeResponse.", 0},
         { "condensed", 'c', "condensed", OPTION_ARG_OPTIONAL , "Use condensed message format", 0},
+		{ "rx-stamp", 300, "none|software|hardware", 0, "Time TimeResponses with the kernel (SO_TIMESTAMPNS) or NIC (SO_TIMESTAMPING) receive stamp instead of reading the clock after recvfrom", 0},
+		{ "stats", 301, 0, 0, "Print the mean and variance of delta to stderr", 0},
+		{ "estimate", 302, 0, 0, "Estimate the clock offset continuously, one TimeRequest per poll interval, for N polls or forever if N is 0", 0},
+		{ "poll", 303, "seconds", 0, "Poll interval for --estimate. 1 by default", 0},
+		{ "stream", 305, 0, 0, "Send paced TimeRequests and print results as they settle, for N requests or forever if N is 0", 0},
+		{ "rate", 306, "rate", 0, "Target TimeRequests per second for --stream. 1000 by default", 0},
+		{ "max-drop", 307, "percent", 0, "Drop percentage above which --stream halves its rate. 5 by default", 0},
+		{ "samples", 304, "samples", 0, "Samples the --estimate filter picks the minimum-delay one from. 8 by default", 0},
 		{0}
 	};
 
@@ -94,6 +155,297 @@ void client_parseopt(struct client_arguments *args,int argc, char *argv[]) {
  
 }
 
+// Write a TimeRequest sent at ts into buffer. Returns its length: 24
+// bytes, or 22 in the condensed format.
+size_t encode_request(uint8_t *buffer, uint32_t seq, const struct timespec *ts, int condensed)
+{
+    struct time_message m = { seq, TIME_VERSION, *ts, { 0, 0 } };
+    return wire_encode(buffer, &m, condensed, 0);
+}
+
+// Wait for the next TimeResponse (bounded by SO_RCVTIMEO, if set, or not
+// at all with MSG_DONTWAIT in flags) and
+// return its sequence number with the three times in seconds: t0 when
+// the request left, t1 the server's time and t2 when the response arrived.
+// Returns -1 on timeout or error.
+int receive_response(int sock, const struct client_arguments *args, int flags, uint32_t *seq,
+                     long double *t0, long double *t1, long double *t2)
+{
+    struct sockaddr_storage fromAddr; // Source address of server
+    int buffer_len = wire_response_size(args->condensed);
+    uint8_t buffer[TIME_RESPONSE_SIZE]; // buffer[40] => [38], if condensed
+    uint8_t control[RX_STAMP_CONTROL_SIZE];
+    struct iovec iov = { buffer, buffer_len };
+    struct msghdr msg = {
+        .msg_name = &fromAddr,
+        .msg_namelen = sizeof(fromAddr),
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    if (recvmsg(sock, &msg, flags) < 0) {
+        return -1;
+    }
+
+    struct timespec tspec;
+    if (args->rx_stamp == RX_STAMP_NONE || !rx_stamp_get(&msg, &tspec))
+        clock_gettime(CLOCK_REALTIME,&tspec);
+
+    struct time_message m;
+    wire_decode(buffer, &m, args->condensed, 1);
+
+    *seq = m.seq;
+    *t0 = m.client.tv_sec + m.client.tv_nsec/1000000000.0L;
+    *t1 = m.server.tv_sec + m.server.tv_nsec/1000000000.0L;
+    *t2 = tspec.tv_sec + tspec.tv_nsec/1000000000.0L;
+    return 0;
+}
+
+void print_estimate(const char *label, const struct estimate *est)
+{
+    printf("%s: offset %+.6f +/- %.6f s, drift %+.3f ppm, delay %.6f s, jitter %.6f s (%d samples)\n",
+           label, est->offset, est->bound, est->drift * 1e6, est->delay, est->jitter, est->samples);
+    fflush(stdout);
+}
+
+// Estimator mode: one TimeRequest every args->poll seconds, each feeding the
+// minimum-delay filter, with the running estimate printed after every poll.
+// Runs for args->reqnum polls and prints the final estimate, or forever if
+// reqnum is 0.
+void run_estimator(int sock, const struct addrinfo *serv_addr, const struct client_arguments *args)
+{
+    struct estimator est;
+    estimator_init(&est, args->samples);
+
+    // Wait at most a poll interval (or -t) for each response
+    double wait = args->timeout > 0 ? args->timeout : args->poll;
+    struct timeval timeout = { (time_t)wait, (suseconds_t)((wait - (time_t)wait) * 1e6) };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // Times are kept relative to the start so doubles keep their precision
+    struct timespec start, next;
+    clock_gettime(CLOCK_REALTIME, &start);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    long double epoch = start.tv_sec + start.tv_nsec / 1000000000.0L;
+
+    for(uint32_t poll = 1; args->reqnum == 0 || poll <= (uint32_t)args->reqnum; poll++){
+        uint8_t buffer[TIME_REQUEST_SIZE];
+        struct timespec tspec;
+        clock_gettime(CLOCK_REALTIME, &tspec);
+        size_t len = encode_request(buffer, poll, &tspec, args->condensed);
+        sendto(sock, buffer, len, 0, serv_addr->ai_addr, serv_addr->ai_addrlen);
+
+        // Late answers to earlier polls are skipped
+        uint32_t seq = 0;
+        long double t0, t1, t2;
+        while(receive_response(sock, args, 0, &seq, &t0, &t1, &t2) >= 0 && seq != poll);
+
+        char label[32];
+        snprintf(label, sizeof(label), "%u", poll);
+        if(seq == poll){
+            estimator_add(&est, t2 - epoch, (t1-t0 + t1 - t2)/2, t2 - t0);
+
+            struct estimate e;
+            estimator_get(&est, t2 - epoch, &e);
+            print_estimate(label, &e);
+        }else{
+            printf("%s: Dropped\n", label);
+            fflush(stdout);
+        }
+
+        next.tv_sec += (time_t)args->poll;
+        next.tv_nsec += (long)((args->poll - (time_t)args->poll) * 1e9);
+        if(next.tv_nsec >= 1000000000){
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000;
+        }
+        if(args->reqnum == 0 || poll < (uint32_t)args->reqnum){
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        }
+    }
+
+    struct estimate e;
+    clock_gettime(CLOCK_REALTIME, &start);
+    if(estimator_get(&est, start.tv_sec + start.tv_nsec / 1000000000.0L - epoch, &e) == 0){
+        print_estimate("final", &e);
+    }else{
+        printf("final: no responses\n");
+    }
+    close(sock);
+    exit(EXIT_SUCCESS);
+}
+
+// Streaming mode keeps every outstanding TimeRequest in a heap ring indexed
+// by seq % size. A slot is settled by its response or by the timeout, and
+// settled results are printed strictly in seq order. The ring doubles
+// whenever the requests in flight would wrap onto an unprinted slot.
+enum pending_state { SLOT_FREE, SLOT_SENT, SLOT_ANSWERED, SLOT_DROPPED };
+
+struct pending {
+    uint32_t seq;
+    uint8_t state;
+    double sent;                // CLOCK_MONOTONIC seconds
+    float theta;
+    float delta;
+};
+
+struct response_ring {
+    struct pending *slots;
+    uint32_t size;              // power of two
+};
+
+#define STREAM_RING_INITIAL 1024
+#define RATE_PERIOD 0.1         // seconds between send rate adjustments
+#define RATE_MIN_SAMPLES 20     // settled requests needed to judge a period
+
+double monotonic_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct pending *ring_slot(struct response_ring *ring, uint32_t seq)
+{
+    return &ring->slots[seq & (ring->size - 1)];
+}
+
+// Double the ring, keeping the slots for seqs first..last-1 in place
+int ring_grow(struct response_ring *ring, uint32_t first, uint32_t last)
+{
+    struct response_ring bigger = { calloc(2 * ring->size, sizeof(struct pending)), 2 * ring->size };
+    if(!bigger.slots) return -1;
+    for(uint32_t seq = first; seq != last; seq++){
+        *ring_slot(&bigger, seq) = *ring_slot(ring, seq);
+    }
+    free(ring->slots);
+    *ring = bigger;
+    return 0;
+}
+
+void print_delta_stats(int n, double sum, double sumsq)
+{
+    double mean = n ? sum / n : 0;
+    double var = n > 1 ? (sumsq - n * mean * mean) / (n - 1) : 0;
+    fprintf(stderr, "delta over %d responses: mean %.3f us, variance %.3f us^2\n", n, mean * 1e6, var * 1e12);
+}
+
+// Send TimeRequests paced at up to args->rate per second, for args->reqnum
+// requests or forever if it is 0, printing results as they settle. The
+// rate backs off by half when more than args->max_drop percent of a
+// period's requests went unanswered and climbs back towards the target by
+// a twentieth of it per period otherwise.
+void run_stream(int sock, const struct addrinfo *serv_addr, const struct client_arguments *args)
+{
+    struct response_ring ring = { calloc(STREAM_RING_INITIAL, sizeof(struct pending)), STREAM_RING_INITIAL };
+    if(!ring.slots){
+        fprintf(stderr, "Error allocating the response ring\n");
+        exit(EXIT_FAILURE);
+    }
+
+    double timeout = args->timeout > 0 ? args->timeout : 1;
+    double rate = args->rate;
+    uint32_t next_seq = 1, next_print = 1;
+    double next_send = monotonic_now();
+    double period_start = next_send;
+    int period_settled = 0, period_dropped = 0;
+    int answered = 0;
+    double sum = 0, sumsq = 0;
+
+    while(args->reqnum == 0 || next_print <= (uint32_t)args->reqnum){
+        double now = monotonic_now();
+        int sending = args->reqnum == 0 || next_seq <= (uint32_t)args->reqnum;
+
+        if(sending && now >= next_send){
+            if(next_seq - next_print >= ring.size && ring_grow(&ring, next_print, next_seq) < 0){
+                fprintf(stderr, "Error growing the response ring\n");
+                exit(EXIT_FAILURE);
+            }
+
+            uint8_t buffer[TIME_REQUEST_SIZE];
+            struct timespec tspec;
+            clock_gettime(CLOCK_REALTIME, &tspec);
+            size_t len = encode_request(buffer, next_seq, &tspec, args->condensed);
+            sendto(sock, buffer, len, 0, serv_addr->ai_addr, serv_addr->ai_addrlen);
+
+            struct pending *p = ring_slot(&ring, next_seq);
+            p->seq = next_seq++;
+            p->state = SLOT_SENT;
+            p->sent = now;
+
+            // Pace from the schedule, not from now, so the average rate holds;
+            // after a long stall start over rather than burst to catch up
+            next_send += 1 / rate;
+            if(next_send < now - 1) next_send = now;
+            continue;
+        }
+
+        // Sleep until the next send, the oldest request's timeout or a response
+        double wake = ring_slot(&ring, next_print)->state == SLOT_SENT ? ring_slot(&ring, next_print)->sent + timeout : now + timeout;
+        if(sending && next_send < wake) wake = next_send;
+        // to the nanosecond: a timeout in whole ms would turn the sub-ms
+        // waits between paced sends into busy polling
+        struct pollfd pfd = { sock, POLLIN, 0 };
+        long long ns = wake > now ? (long long)ceil((wake - now) * 1e9) : 0;
+        struct timespec wait = { ns / 1000000000, ns % 1000000000 };
+        if(ppoll(&pfd, 1, &wait, NULL) > 0){
+            uint32_t seq;
+            long double t0, t1, t2;
+            while(receive_response(sock, args, MSG_DONTWAIT, &seq, &t0, &t1, &t2) >= 0){
+                struct pending *p = ring_slot(&ring, seq);
+                // Duplicates and answers to slots already timed out are ignored
+                if(seq - next_print >= next_seq - next_print || p->seq != seq || p->state != SLOT_SENT) continue;
+                p->state = SLOT_ANSWERED;
+                p->theta = (t1-t0 + t1 - t2)/2;
+                p->delta = t2 - t0;
+            }
+        }
+
+        // Settle and print everything that is done, in order
+        now = monotonic_now();
+        while(next_print != next_seq){
+            struct pending *p = ring_slot(&ring, next_print);
+            if(p->state == SLOT_SENT && now - p->sent >= timeout) p->state = SLOT_DROPPED;
+            if(p->state == SLOT_SENT) break;
+
+            if(p->state == SLOT_ANSWERED){
+                printf("%u: %.4f %.4f\n", p->seq, p->theta, p->delta);
+                answered++;
+                sum += p->delta;
+                sumsq += (double)p->delta * p->delta;
+            }else{
+                printf("%u: Dropped\n", p->seq);
+                period_dropped++;
+            }
+            period_settled++;
+            p->state = SLOT_FREE;
+            next_print++;
+        }
+
+        if(now - period_start >= RATE_PERIOD && period_settled >= RATE_MIN_SAMPLES){
+            if(100.0 * period_dropped / period_settled > args->max_drop){
+                rate = rate / 2 > 1 ? rate / 2 : 1;
+                fprintf(stderr, "%d%% of requests dropped, backing off to %.0f requests/s\n",
+                        100 * period_dropped / period_settled, rate);
+            }else if(rate < args->rate){
+                rate += args->rate / 20;
+                if(rate > args->rate) rate = args->rate;
+            }
+            period_start = now;
+            period_settled = period_dropped = 0;
+        }
+    }
+
+    if(args->stats){
+        print_delta_stats(answered, sum, sumsq);
+    }
+    free(ring.slots);
+    close(sock);
+    exit(EXIT_SUCCESS);
+}
+
 int main(int argc, char *argv[]){
 
     struct client_arguments args;
@@ -134,98 +486,41 @@ int main(int argc, char *argv[]){
     int sock = socket(serv_addr->ai_family, serv_addr->ai_socktype, serv_addr->ai_protocol); // Socket descriptor for client
     if (sock < 0)
         fprintf(stderr, "socket failed\n");
+    if (rx_stamp_enable(sock, args.rx_stamp) < 0)
+        fprintf(stderr, "Receive stamps not supported, reading the clock instead\n");
+
+    if(args.estimate){
+        run_estimator(sock, serv_addr, &args);
+    }
+    if(args.stream){
+        run_stream(sock, serv_addr, &args);
+    }
 
     for(int i = 0; i < args.reqnum; i++){
 
-        uint8_t buffer[SEND_BUFFER_SIZE + (args.condensed ? -2 : 0)]; // if condesed, should be 22
+        uint8_t buffer[TIME_REQUEST_SIZE]; // if condesed, should be 22
         
         struct timespec tspec;
         clock_gettime(CLOCK_REALTIME,&tspec);
-        time_t sec = tspec.tv_sec;
-        long nanosec = tspec.tv_nsec;
-
-        uint32_t seq = i+1;
-        seq = htonl(seq);
-        uint64_t sec_nb = htobe64(sec);
-        uint64_t nanosec_nb = htobe64(nanosec);
-
-        memcpy(buffer, &seq, 4);
-
-        if(args.condensed) {
-            uint16_t ver = htons(7);
-            memcpy(buffer+4, &ver, 2);
-            memcpy(buffer+6, &sec_nb, 8);
-            memcpy(buffer+14, &nanosec_nb, 8);
-        } else {
-            uint32_t ver = htonl(7);
-            memcpy(buffer+4, &ver, 4);
-            memcpy(buffer+8, &sec_nb, 8);
-            memcpy(buffer+16, &nanosec_nb, 8);
-        }
-        // 24 => 22, if condensed
-        sendto(sock, buffer, SEND_BUFFER_SIZE + (args.condensed ? -2 : 0) ,0, serv_addr->ai_addr, serv_addr->ai_addrlen); 
+        size_t len = encode_request(buffer, i+1, &tspec, args.condensed);
+        sendto(sock, buffer, len, 0, serv_addr->ai_addr, serv_addr->ai_addrlen); 
 
     }
 
     struct timeval timeout={args.timeout,0}; 
     setsockopt(sock,SOL_SOCKET,SO_RCVTIMEO,(char*)&timeout,sizeof(struct timeval));
-    struct sockaddr_storage fromAddr; // Source address of server
-    socklen_t fromAddrLen = sizeof(fromAddr);
 
     Response responses[args.reqnum];
     memset(responses, 0, args.reqnum*sizeof(Response));
     
-    int buffer_len = RECV_BUFFER_SIZE + (args.condensed ? -2 : 0);
     for(int i = 0; i < args.reqnum; i++){
-        uint8_t buffer[buffer_len]; // buffer[40] => [38], if condensed
-        int recvlen = recvfrom(sock, buffer, buffer_len, 0, (struct sockaddr *)&fromAddr, &fromAddrLen);
-        if (recvlen >= 0) {
-
-            struct timespec tspec;
-            clock_gettime(CLOCK_REALTIME,&tspec);
-            time_t client_sec2 = tspec.tv_sec;
-            long client_nanosec2 = tspec.tv_nsec;
-
-            uint32_t seq;
-            uint64_t client_sec1;
-            uint64_t client_nanosec1;
-            uint64_t serv_sec;
-            uint64_t serv_nanosec;
-
-            if(args.condensed) {
-                uint16_t ver;
-                memcpy(&seq, buffer,4);
-                memcpy(&ver, buffer+4,2);
-                memcpy(&client_sec1, buffer+6,8);            
-                memcpy(&client_nanosec1, buffer+14,8);
-                memcpy(&serv_sec, buffer+22,8);
-                memcpy(&serv_nanosec, buffer+30,8);
-                ver = ntohs(ver);
-            } else {
-                uint32_t ver;
-                memcpy(&seq, buffer,4);
-                memcpy(&ver, buffer+4,4);
-                memcpy(&client_sec1, buffer+8,8);            
-                memcpy(&client_nanosec1, buffer+16,8);
-                memcpy(&serv_sec, buffer+24,8);
-                memcpy(&serv_nanosec, buffer+32,8);
-                ver = ntohl(ver);
-            }
-           
-            seq = ntohl(seq);
-            client_sec1 = be64toh(client_sec1);
-            client_nanosec1 = be64toh(client_nanosec1);
-            serv_sec = be64toh(serv_sec);
-            serv_nanosec = be64toh(serv_nanosec);
-
-            if(responses[seq-1].seq != 0){
-                //Duplicate TimeResponse
+        uint32_t seq;
+        long double t0, t1, t2;
+        if (receive_response(sock, &args, 0, &seq, &t0, &t1, &t2) >= 0) {
+            if(seq < 1 || seq > (uint32_t)args.reqnum || responses[seq-1].seq != 0){
+                //Duplicate or stray TimeResponse
                 i--;
             }else{
-                long double t0 = client_sec1 + client_nanosec1/1000000000.0;
-                long double t1 = serv_sec + serv_nanosec/1000000000.0;
-                long double t2 = client_sec2 + client_nanosec2/1000000000.0;
-        
                 float theta = (t1-t0 + t1 - t2)/2;
                 float delta = t2 - t0;
                 responses[seq-1].seq = seq;
@@ -246,4 +541,16 @@ int main(int argc, char *argv[]){
         else
             printf("%d: %.4f %.4f\n", i+1, responses[i].theta, responses[i].delta);
     }
+
+    if(args.stats){
+        double sum = 0, sumsq = 0;
+        int n = 0;
+        for(int i = 0; i < args.reqnum; i++){
+            if(responses[i].seq == 0) continue;
+            sum += responses[i].delta;
+            sumsq += (double)responses[i].delta * responses[i].delta;
+            n++;
+        }
+        print_delta_stats(n, sum, sumsq);
+    }
 }
\ No newline at end of file
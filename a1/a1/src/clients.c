@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "clients.h"
+
+#define INITIAL_SLOTS 1024
+#define SWEEP_STEP 8            // slots each update checks for expired clients
+#define EVICT_SAMPLES 8         // clients compared to pick one to evict
+
+void client_key_from(struct client_key *key, const struct sockaddr_storage *addr)
+{
+    memset(key, 0, sizeof(*key));
+    if(addr->ss_family == AF_INET){
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        key->addr[10] = key->addr[11] = 0xff;
+        memcpy(key->addr + 12, &in->sin_addr, 4);
+        key->port = in->sin_port;
+    }else if(addr->ss_family == AF_INET6){
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        memcpy(key->addr, &in6->sin6_addr, 16);
+        key->port = in6->sin6_port;
+    }
+}
+
+static uint32_t key_hash(const struct client_key *key)
+{
+    uint64_t a, b;
+    memcpy(&a, key->addr, 8);
+    memcpy(&b, key->addr + 8, 8);
+
+    uint64_t h = (a ^ (b * 0x9e3779b97f4a7c15ull) ^ key->port) * 0xff51afd7ed558ccdull;
+    h ^= h >> 32;
+    return (uint32_t)h;
+}
+
+// Home slot: the hash scaled onto the table, which needs no power-of-two size
+static uint32_t home_slot(const struct client_table *table, const struct client_key *key)
+{
+    return ((uint64_t)key_hash(key) * table->size) >> 32;
+}
+
+static uint32_t next_slot(const struct client_table *table, uint32_t i)
+{
+    return i + 1 == table->size ? 0 : i + 1;
+}
+
+// Probe distance from a to b
+static uint32_t distance(const struct client_table *table, uint32_t a, uint32_t b)
+{
+    return b >= a ? b - a : b + table->size - a;
+}
+
+static int key_equal(const struct client_key *a, const struct client_key *b)
+{
+    return a->port == b->port && memcmp(a->addr, b->addr, 16) == 0;
+}
+
+static int expired(const struct client_table *table, const struct client *c, time_t now)
+{
+    return now - table->epoch - c->stamp >= CLIENT_TIMEOUT;
+}
+
+static struct client *alloc_slots(uint32_t size)
+{
+    struct client *slots = malloc(size * sizeof(*slots));
+    if(slots){
+        for(uint32_t i = 0; i < size; i++){
+            slots[i].key.port = 0;
+        }
+    }
+    return slots;
+}
+
+int client_table_init(struct client_table *table, size_t max_bytes)
+{
+    memset(table, 0, sizeof(*table));
+
+    size_t max_slots = max_bytes ? max_bytes / sizeof(struct client) : UINT32_MAX;
+    table->max_slots = max_slots < INITIAL_SLOTS ? INITIAL_SLOTS : max_slots > UINT32_MAX ? UINT32_MAX : max_slots;
+
+    if(!(table->slots = alloc_slots(INITIAL_SLOTS))) return -1;
+    table->size = INITIAL_SLOTS;
+    table->epoch = time(NULL);
+    table->rng = (uint64_t)table->epoch | 1;
+    return 0;
+}
+
+void client_table_free(struct client_table *table)
+{
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+
+// Backward-shift deletion: pull later members of the probe run into the
+// hole until reaching an empty slot or an entry already at its home slot
+static void remove_slot(struct client_table *table, uint32_t hole)
+{
+    uint32_t i = hole;
+    while(1){
+        i = next_slot(table, i);
+        if(table->slots[i].key.port == 0) break;
+
+        uint32_t home = home_slot(table, &table->slots[i].key);
+        if(distance(table, home, i) >= distance(table, hole, i)){
+            table->slots[hole] = table->slots[i];
+            hole = i;
+        }
+    }
+    table->slots[hole].key.port = 0;
+    table->count--;
+}
+
+// Check the next steps slots for expired clients. A removal shifts a later
+// client into the slot, so the slot is checked again.
+static void sweep(struct client_table *table, uint32_t steps, time_t now)
+{
+    for(uint32_t n = 0; n < steps; n++){
+        struct client *c = &table->slots[table->sweep];
+        if(c->key.port != 0 && expired(table, c, now)){
+            remove_slot(table, table->sweep);
+        }else{
+            table->sweep = next_slot(table, table->sweep);
+        }
+    }
+}
+
+// Grow by half, or up to the cap
+static int grow(struct client_table *table)
+{
+    struct client_table bigger = *table;
+    uint64_t size = table->size + table->size / 2;
+    bigger.size = size < table->max_slots ? size : table->max_slots;
+    if(!(bigger.slots = alloc_slots(bigger.size))) return -1;
+
+    for(uint32_t i = 0; i < table->size; i++){
+        if(table->slots[i].key.port == 0) continue;
+        uint32_t j = home_slot(&bigger, &table->slots[i].key);
+        while(bigger.slots[j].key.port != 0){
+            j = next_slot(&bigger, j);
+        }
+        bigger.slots[j] = table->slots[i];
+    }
+    free(table->slots);
+    bigger.sweep = 0;
+    *table = bigger;
+    return 0;
+}
+
+// Forget the least recently updated of EVICT_SAMPLES clients found from a
+// random slot on
+static void evict(struct client_table *table)
+{
+    table->rng ^= table->rng << 13;
+    table->rng ^= table->rng >> 7;
+    table->rng ^= table->rng << 17;
+
+    uint32_t i = table->rng % table->size, victim = i;
+    int found = 0;
+    while(found < EVICT_SAMPLES){
+        const struct client *c = &table->slots[i];
+        if(c->key.port != 0){
+            if(found++ == 0 || c->stamp < table->slots[victim].stamp) victim = i;
+        }
+        i = next_slot(table, i);
+    }
+    remove_slot(table, victim);
+    table->evictions++;
+}
+
+// Make room for one more client. Under the cap, a full sweep (no dearer
+// than the growth it may save) reclaims expired clients and the table
+// only grows if that left it over half full. At the cap the incremental
+// sweep is all the reclaiming there is, and a stale client is evicted.
+static int make_room(struct client_table *table, time_t now)
+{
+    if(table->size < table->max_slots){
+        sweep(table, table->size, now);
+        return 2 * (table->count + 1) > table->size ? grow(table) : 0;
+    }
+    evict(table);
+    return 0;
+}
+
+int client_table_update(struct client_table *table, const struct client_key *key,
+                        uint32_t seq, time_t now, uint32_t *latest)
+{
+    if(key->port == 0) return 0;
+
+    sweep(table, SWEEP_STEP, now);
+
+    uint32_t i = home_slot(table, key);
+    for(; table->slots[i].key.port != 0; i = next_slot(table, i)){
+        struct client *c = &table->slots[i];
+        if(!key_equal(&c->key, key)) continue;
+
+        if(c->seq > seq && !expired(table, c, now)){
+            *latest = c->seq;
+            return 1;
+        }
+        c->seq = seq;
+        c->stamp = now - table->epoch;
+        return 0;
+    }
+
+    // New client. Keep the load factor at or under 3/4.
+    if(4 * (uint64_t)(table->count + 1) > 3 * (uint64_t)table->size){
+        if(make_room(table, now) < 0) return -1;
+        i = home_slot(table, key);
+        while(table->slots[i].key.port != 0){
+            i = next_slot(table, i);
+        }
+    }
+
+    struct client *c = &table->slots[i];
+    c->key = *key;
+    c->seq = seq;
+    c->stamp = now - table->epoch;
+    table->count++;
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include <math.h>
+#include <string.h>
+
+#include "estimator.h"
+
+void estimator_init(struct estimator *e, int window)
+{
+    memset(e, 0, sizeof(*e));
+    if(window < 1) window = 1;
+    if(window > ESTIMATOR_MAX_SAMPLES) window = ESTIMATOR_MAX_SAMPLES;
+    e->window = window;
+    e->last_selected = -1;
+}
+
+static int window_size(const struct estimator *e)
+{
+    return e->count < e->window ? e->count : e->window;
+}
+
+// Minimum-delay sample of the window
+static const struct offset_sample *select_sample(const struct estimator *e)
+{
+    const struct offset_sample *best = &e->samples[0];
+    for(int i = 1; i < window_size(e); i++){
+        if(e->samples[i].delta < best->delta) best = &e->samples[i];
+    }
+    return best;
+}
+
+void estimator_add(struct estimator *e, double time, double theta, double delta)
+{
+    struct offset_sample *s = &e->samples[e->count % e->window];
+    s->time = time;
+    s->theta = theta;
+    s->delta = delta;
+    e->count++;
+
+    // Only a newly selected sample adds information to the drift fit
+    const struct offset_sample *sel = select_sample(e);
+    if(sel->time != e->last_selected){
+        e->history[e->history_count % ESTIMATOR_HISTORY] = *sel;
+        e->history_count++;
+        e->last_selected = sel->time;
+    }
+}
+
+// Least-squares slope of theta against time over the selected samples
+static double fit_drift(const struct estimator *e)
+{
+    int n = e->history_count < ESTIMATOR_HISTORY ? e->history_count : ESTIMATOR_HISTORY;
+    if(n < 2) return 0;
+
+    double mean_t = 0, mean_o = 0;
+    for(int i = 0; i < n; i++){
+        mean_t += e->history[i].time;
+        mean_o += e->history[i].theta;
+    }
+    mean_t /= n;
+    mean_o /= n;
+
+    double num = 0, den = 0;
+    for(int i = 0; i < n; i++){
+        double dt = e->history[i].time - mean_t;
+        num += dt * (e->history[i].theta - mean_o);
+        den += dt * dt;
+    }
+    return den > 0 ? num / den : 0;
+}
+
+int estimator_get(const struct estimator *e, double now, struct estimate *out)
+{
+    if(e->count == 0) return -1;
+
+    const struct offset_sample *sel = select_sample(e);
+    int n = window_size(e);
+
+    double sq = 0;
+    for(int i = 0; i < n; i++){
+        double d = e->samples[i].theta - sel->theta;
+        sq += d * d;
+    }
+
+    out->samples = n;
+    out->delay = sel->delta;
+    out->jitter = sqrt(sq / n);
+    out->drift = fit_drift(e);
+    out->offset = sel->theta + out->drift * (now - sel->time);
+    // An asymmetric path can put the true offset anywhere within half the
+    // round trip of theta; the jitter covers how far the filter may be off
+    out->bound = sel->delta / 2 + out->jitter;
+    return 0;
+}
@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "impair.h"
+
+int impair_configured(const struct impair_config *config)
+{
+    return config->ge_p > 0 || config->loss_good > 0 || config->delay > 0 || config->jitter > 0
+        || config->duplicate > 0 || config->reorder > 0;
+}
+
+int impair_init(struct impair *im, const struct impair_config *config, uint64_t seed)
+{
+    memset(im, 0, sizeof(*im));
+    im->config = config;
+    im->rng = seed ? seed : 1;
+    im->heap = malloc(config->limit * sizeof(*im->heap));
+    return im->heap ? 0 : -1;
+}
+
+void impair_free(struct impair *im)
+{
+    free(im->heap);
+    memset(im, 0, sizeof(*im));
+}
+
+// Uniform on [0, 1)
+static double uniform(struct impair *im)
+{
+    im->rng ^= im->rng >> 12;
+    im->rng ^= im->rng << 25;
+    im->rng ^= im->rng >> 27;
+    return ((im->rng * 0x2545f4914f6cdd1dull) >> 11) * (1.0 / (1ull << 53));
+}
+
+// Loss by the current state, then the state's transition
+static int lost(struct impair *im)
+{
+    const struct impair_config *c = im->config;
+    int lose = uniform(im) < (im->bad ? c->loss_bad : c->loss_good);
+    if(uniform(im) < (im->bad ? c->ge_r : c->ge_p)) im->bad = !im->bad;
+    return lose;
+}
+
+static int before(const struct delayed_packet *a, const struct delayed_packet *b)
+{
+    return a->due < b->due || (a->due == b->due && a->order < b->order);
+}
+
+static void heap_push(struct impair *im, const struct delayed_packet *p)
+{
+    int i = im->count++;
+    while(i > 0 && before(p, &im->heap[(i - 1) / 2])){
+        im->heap[i] = im->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    im->heap[i] = *p;
+}
+
+static void heap_pop(struct impair *im)
+{
+    struct delayed_packet *last = &im->heap[--im->count];
+    int i = 0;
+    while(1){
+        int child = 2 * i + 1;
+        if(child >= im->count) break;
+        if(child + 1 < im->count && before(&im->heap[child + 1], &im->heap[child])) child++;
+        if(!before(&im->heap[child], last)) break;
+        im->heap[i] = im->heap[child];
+        i = child;
+    }
+    im->heap[i] = *last;
+}
+
+static void delay(struct impair *im, const void *buf, size_t len,
+                  const struct sockaddr *addr, socklen_t addr_len, uint64_t now)
+{
+    const struct impair_config *c = im->config;
+    if(im->count == c->limit) return;
+
+    double d = c->delay + c->jitter * (2 * uniform(im) - 1);
+    struct delayed_packet p;
+    p.due = now + (d > 0 ? (uint64_t)(d * 1e9) : 0);
+    p.order = im->order++;
+    memcpy(&p.addr, addr, addr_len);
+    p.addr_len = addr_len;
+    p.len = len;
+    memcpy(p.data, buf, len);
+    heap_push(im, &p);
+}
+
+void impair_sendto(struct impair *im, int sock, const void *buf, size_t len,
+                   const struct sockaddr *addr, socklen_t addr_len, uint64_t now)
+{
+    const struct impair_config *c = im->config;
+    if(lost(im)) return;
+
+    int copies = 1 + (uniform(im) < c->duplicate);
+    for(int i = 0; i < copies; i++){
+        // A reordered datagram overtakes everything still being delayed
+        if((c->delay <= 0 && c->jitter <= 0) || uniform(im) < c->reorder || len > IMPAIR_MAX_PACKET){
+            sendto(sock, buf, len, 0, addr, addr_len);
+        }else{
+            delay(im, buf, len, addr, addr_len, now);
+        }
+    }
+}
+
+int64_t impair_flush(struct impair *im, int sock, uint64_t now)
+{
+    while(im->count > 0 && im->heap[0].due <= now){
+        struct delayed_packet *p = &im->heap[0];
+        sendto(sock, p->data, p->len, 0, (struct sockaddr *)&p->addr, p->addr_len);
+        heap_pop(im);
+    }
+    return im->count > 0 ? (int64_t)(im->heap[0].due - now) : -1;
+}
@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "clients.h"
+#include "ratelimit.h"
+
+#define TICK_SHIFT 14           // ns per tick, as a power of two
+#define TAT_BITS 44
+#define TAT_MASK ((1ull << TAT_BITS) - 1)
+#define LINE_SLOTS 8            // one 64-byte cache line
+
+#define WORD(tag, tat) ((uint64_t)(tag) << TAT_BITS | ((tat) & TAT_MASK))
+#define WORD_TAG(w) ((w) >> TAT_BITS)
+#define WORD_TAT(w) ((w) & TAT_MASK)
+
+int rate_limit_configured(const struct limit_config *config)
+{
+    return config->source_rate > 0 || config->global_rate > 0;
+}
+
+int rate_limiter_init(struct rate_limiter *l, const struct limit_config *config, uint64_t now)
+{
+    memset(l, 0, sizeof(*l));
+    l->start = now;
+
+    if(config->source_rate > 0){
+        uint64_t size = LINE_SLOTS;
+        while(size < (uint64_t)config->sources) size *= 2;
+        l->slots = aligned_alloc(64, size * sizeof(*l->slots));
+        if(!l->slots) return -1;
+        for(uint64_t i = 0; i < size; i++){
+            atomic_init(&l->slots[i], 0);
+        }
+        l->mask = size - 1;
+
+        double interval = 1e9 / config->source_rate / (1 << TICK_SHIFT);
+        l->interval = interval >= 1 ? (uint64_t)(interval + 0.5) : 1;
+        l->tolerance = (config->source_burst > 1 ? config->source_burst - 1 : 0) * l->interval;
+    }
+    if(config->global_rate > 0){
+        l->global_interval = 1e9 / config->global_rate;
+        if(l->global_interval == 0) l->global_interval = 1;
+        l->global_tolerance = (config->global_burst > 1 ? config->global_burst - 1 : 0) * l->global_interval;
+    }
+    atomic_init(&l->global_tat, 0);
+    atomic_init(&l->evictions, 0);
+    return 0;
+}
+
+void rate_limiter_free(struct rate_limiter *l)
+{
+    free(l->slots);
+    memset(l, 0, sizeof(*l));
+}
+
+static uint64_t source_hash(const struct sockaddr_storage *addr)
+{
+    struct client_key key;
+    uint64_t a, b;
+    client_key_from(&key, addr);
+    memcpy(&a, key.addr, 8);
+    memcpy(&b, key.addr + 8, 8);
+
+    uint64_t h = (a ^ (b * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull;
+    return h ^ (h >> 29);
+}
+
+// Returns the slot charged for the request, NULL if the source is over its
+// limit
+static _Atomic uint64_t *source_admit(struct rate_limiter *l, _Atomic uint64_t *line, uint64_t tag, uint64_t now)
+{
+    while(1){
+        int victim = 0;
+        uint64_t victim_word = 0, victim_tat = UINT64_MAX;
+
+        for(int i = 0; i < LINE_SLOTS; i++){
+            uint64_t w = atomic_load_explicit(&line[i], memory_order_relaxed);
+            while(WORD_TAG(w) == tag){
+                uint64_t tat = WORD_TAT(w) > now ? WORD_TAT(w) : now;
+                if(tat - now > l->tolerance) return NULL;
+                if(atomic_compare_exchange_weak_explicit(&line[i], &w, WORD(tag, tat + l->interval),
+                                                         memory_order_relaxed, memory_order_relaxed)){
+                    return &line[i];
+                }
+                // Lost a race; w now holds the slot's current word, which
+                // may belong to another source by now
+            }
+            uint64_t tat = w ? WORD_TAT(w) : 0;
+            if(tat < victim_tat){
+                victim = i;
+                victim_word = w;
+                victim_tat = tat;
+            }
+        }
+
+        // A new source. If the slot changed under us, look again.
+        if(atomic_compare_exchange_strong_explicit(&line[victim], &victim_word, WORD(tag, now + l->interval),
+                                                   memory_order_relaxed, memory_order_relaxed)){
+            if(victim_word && victim_tat > now){
+                atomic_fetch_add_explicit(&l->evictions, 1, memory_order_relaxed);
+            }
+            return &line[victim];
+        }
+    }
+}
+
+// Give back the token source_admit took from slot. Nothing to give back if
+// the source has been evicted from it since.
+static void source_refund(struct rate_limiter *l, _Atomic uint64_t *slot, uint64_t tag)
+{
+    uint64_t w = atomic_load_explicit(slot, memory_order_relaxed);
+    while(WORD_TAG(w) == tag){
+        uint64_t tat = WORD_TAT(w) > l->interval ? WORD_TAT(w) - l->interval : 0;
+        if(atomic_compare_exchange_weak_explicit(slot, &w, WORD(tag, tat),
+                                                 memory_order_relaxed, memory_order_relaxed)){
+            return;
+        }
+    }
+}
+
+static int global_admit(struct rate_limiter *l, uint64_t now)
+{
+    uint64_t stored = atomic_load_explicit(&l->global_tat, memory_order_relaxed);
+    while(1){
+        uint64_t tat = stored > now ? stored : now;
+        if(tat - now > l->global_tolerance) return 0;
+        if(atomic_compare_exchange_weak_explicit(&l->global_tat, &stored, tat + l->global_interval,
+                                                 memory_order_relaxed, memory_order_relaxed)){
+            return 1;
+        }
+    }
+}
+
+enum limit_verdict rate_limiter_check(struct rate_limiter *l, const struct sockaddr_storage *addr, uint64_t now)
+{
+    _Atomic uint64_t *slot = NULL;
+    uint64_t tag = 0;
+
+    if(l->slots){
+        uint64_t h = source_hash(addr);
+        tag = WORD_TAG(h) ? WORD_TAG(h) : 1;
+        _Atomic uint64_t *line = &l->slots[h & l->mask & ~(uint64_t)(LINE_SLOTS - 1)];
+        if(!(slot = source_admit(l, line, tag, (now - l->start) >> TICK_SHIFT))) return LIMIT_SOURCE;
+    }
+    if(l->global_interval && !global_admit(l, now)){
+        // Dropped without a reply, so the source isn't charged for it
+        if(slot) source_refund(l, slot, tag);
+        return LIMIT_GLOBAL;
+    }
+    return LIMIT_PASS;
+}
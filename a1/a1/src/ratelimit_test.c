@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "ratelimit.h"
+
+// Checks for the rate limiter, run by make test. Times are made up, so the
+// results don't depend on how fast this runs.
+
+#define MS 1000000ull
+
+static int failures;
+
+static void expect(const char *what, enum limit_verdict got, enum limit_verdict want)
+{
+    static const char *names[] = { "pass", "source", "global" };
+    if(got != want){
+        fprintf(stderr, "FAIL %s: got %s, want %s\n", what, names[got], names[want]);
+        failures++;
+    }
+}
+
+static struct sockaddr_storage source(const char *ip)
+{
+    struct sockaddr_storage ss;
+    struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+    memset(&ss, 0, sizeof(ss));
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(9000);
+    inet_pton(AF_INET, ip, &sin->sin_addr);
+    return ss;
+}
+
+// A request the global cap turns away keeps its source's token, so the
+// same source gets through once the global bucket has room again
+static void global_reject_refunds_source(void)
+{
+    struct limit_config config = {
+        .source_rate = 1, .source_burst = 2,
+        .global_rate = 1000, .global_burst = 1,
+        .sources = 64,
+    };
+    struct rate_limiter l;
+    struct sockaddr_storage a = source("10.0.0.1");
+    uint64_t t = 1000 * MS;
+
+    if(rate_limiter_init(&l, &config, t) != 0){
+        fprintf(stderr, "FAIL rate_limiter_init\n");
+        exit(EXIT_FAILURE);
+    }
+
+    expect("first request", rate_limiter_check(&l, &a, t), LIMIT_PASS);
+    expect("over the global cap", rate_limiter_check(&l, &a, t), LIMIT_GLOBAL);
+    expect("over the global cap again", rate_limiter_check(&l, &a, t), LIMIT_GLOBAL);
+    expect("after the global cap refills", rate_limiter_check(&l, &a, t + 1 * MS), LIMIT_PASS);
+    expect("source burst spent", rate_limiter_check(&l, &a, t + 2 * MS), LIMIT_SOURCE);
+
+    rate_limiter_free(&l);
+}
+
+// One source flooding past the global cap doesn't use up another's burst
+static void global_flood_spares_others(void)
+{
+    struct limit_config config = {
+        .source_rate = 1, .source_burst = 3,
+        .global_rate = 1000, .global_burst = 1,
+        .sources = 64,
+    };
+    struct rate_limiter l;
+    struct sockaddr_storage a = source("10.0.0.1");
+    struct sockaddr_storage b = source("10.0.0.2");
+    uint64_t t = 1000 * MS;
+
+    if(rate_limiter_init(&l, &config, t) != 0){
+        fprintf(stderr, "FAIL rate_limiter_init\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for(int i = 0; i < 3; i++){
+        uint64_t now = t + i * MS;
+        expect("flooder takes the global token", rate_limiter_check(&l, &a, now), LIMIT_PASS);
+        expect("well-behaved source behind the flood", rate_limiter_check(&l, &b, now), LIMIT_GLOBAL);
+    }
+    for(int i = 3; i < 6; i++){
+        expect("well-behaved source keeps its burst", rate_limiter_check(&l, &b, t + i * MS), LIMIT_PASS);
+    }
+
+    rate_limiter_free(&l);
+}
+
+int main(void)
+{
+    global_reject_refunds_source();
+    global_flood_spares_others();
+
+    if(failures){
+        fprintf(stderr, "%d failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("ratelimit: ok\n");
+    return 0;
+}
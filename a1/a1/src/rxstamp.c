@@ -0,0 +1,50 @@
+#include <string.h>
+#include <time.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#include "rxstamp.h"
+
+int rx_stamp_parse(const char *name)
+{
+    if(!strcmp(name, "none")) return RX_STAMP_NONE;
+    if(!strcmp(name, "software")) return RX_STAMP_SOFTWARE;
+    if(!strcmp(name, "hardware")) return RX_STAMP_HARDWARE;
+    return -1;
+}
+
+int rx_stamp_enable(int sock, enum rx_stamp_mode mode)
+{
+    int on = 1;
+    int flags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE
+              | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+    switch(mode){
+    case RX_STAMP_SOFTWARE:
+        return setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+    case RX_STAMP_HARDWARE:
+        return setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+    default:
+        return 0;
+    }
+}
+
+int rx_stamp_get(struct msghdr *msg, struct timespec *ts)
+{
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)){
+        if(cmsg->cmsg_level != SOL_SOCKET) continue;
+
+        if(cmsg->cmsg_type == SCM_TIMESTAMPNS){
+            memcpy(ts, CMSG_DATA(cmsg), sizeof(*ts));
+            return 1;
+        }
+        if(cmsg->cmsg_type == SCM_TIMESTAMPING){
+            // ts[0] is the software stamp, ts[2] the raw hardware one
+            struct scm_timestamping stamps;
+            memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+            *ts = (stamps.ts[2].tv_sec || stamps.ts[2].tv_nsec) ? stamps.ts[2] : stamps.ts[0];
+            return ts->tv_sec || ts->tv_nsec;
+        }
+    }
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,27 +13,54 @@
 #include <netdb.h>
 #include <endian.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
-#define SEND_BUFFER_SIZE 40
-#define RECV_BUFFER_SIZE 24
+#include "clients.h"
+#include "rxstamp.h"
+#include "wire.h"
+#include "impair.h"
+#include "ratelimit.h"
+
+#define BATCH_SIZE 64       // TimeRequests per recvmmsg/sendmmsg
+#define BENCH_SECONDS 2
+#define BENCH_WINDOW 256    // requests the benchmark load keeps in flight
 
 struct server_arguments {
 	int port;
 	int drop_percent;
     int condensed;
+    int batch;
+    int bench;
+    int workers;
+    enum rx_stamp_mode rx_stamp;
+    struct impair_config impair;
+    struct limit_config limit;
+    long bench_clients;
+    size_t client_memory;       // bytes, shared out between the workers; 0 for no cap
+    int limit_report;           // seconds between limiter counter reports
 };
 
-typedef struct listnode {
-    time_t last_update;
-    int seq;
-    char addr[1025];
-    char port[1025];
-    struct listnode *next;
-}Node;
+// One serving thread. With --workers every worker owns its socket, its
+// share of the clients and its drop PRNG, so workers never share state.
+struct worker {
+    pthread_t tid;
+    int sock;
+    const struct server_arguments *args;
+    struct client_table clients;
+    unsigned seed;              // rand_r state for drop_percent
+    struct impair impair;       // config is NULL when responses go out untouched
+    struct rate_limiter *limiter;   // shared by all workers, NULL without limits
+    _Atomic uint64_t passed;        // requests by limiter verdict
+    _Atomic uint64_t over_source;
+    _Atomic uint64_t over_global;
+};
 
 error_t server_parser(int key, char *arg, struct argp_state *state) {
 	struct server_arguments *args = state->input;
 	error_t ret = 0;
+	int mode, n;
 	switch(key) {
 	case 'p':
 		/* Validate that port is correct and a number, etc!! */
@@ -47,6 +75,90 @@ error_t server_parser(int key, char *arg, struct argp_state *state) {
     case 'c':
 		args->condensed = 1;
 		break;
+	case 'b':
+		args->batch = 1;
+		break;
+	case 300:
+		args->bench = 1;
+		break;
+	case 301:
+		if ((mode = rx_stamp_parse(arg)) < 0) {
+			argp_error(state, "Receive stamps must be none, software or hardware");
+		}
+		args->rx_stamp = mode;
+		break;
+	case 302:
+		n = sscanf(arg, "%lf,%lf,%lf,%lf", &args->impair.ge_p, &args->impair.ge_r,
+		           &args->impair.loss_bad, &args->impair.loss_good);
+		if (n < 2) {
+			argp_error(state, "Gilbert-Elliott loss takes p,r[,bad loss[,good loss]] in percent");
+		}
+		args->impair.ge_p /= 100;
+		args->impair.ge_r /= 100;
+		args->impair.loss_bad = n > 2 ? args->impair.loss_bad / 100 : 1;
+		args->impair.loss_good = n > 3 ? args->impair.loss_good / 100 : 0;
+		break;
+	case 303:
+		n = sscanf(arg, "%lf,%lf", &args->impair.delay, &args->impair.jitter);
+		if (n < 1 || args->impair.delay < 0 || args->impair.jitter < 0) {
+			argp_error(state, "Delay takes ms[,jitter ms]");
+		}
+		args->impair.delay /= 1000;
+		args->impair.jitter = n > 1 ? args->impair.jitter / 1000 : 0;
+		break;
+	case 304:
+		args->impair.duplicate = atof(arg) / 100;
+		break;
+	case 305:
+		args->impair.reorder = atof(arg) / 100;
+		break;
+	case 306:
+		args->impair.limit = atoi(arg);
+		if (args->impair.limit < 1) {
+			argp_error(state, "Queue limit must be at least 1");
+		}
+		break;
+	case 307:
+		n = sscanf(arg, "%lf,%lf", &args->limit.source_rate, &args->limit.source_burst);
+		if (n < 1 || args->limit.source_rate <= 0) {
+			argp_error(state, "Per-source limit takes requests/s[,burst]");
+		}
+		if (n < 2) args->limit.source_burst = args->limit.source_rate;
+		break;
+	case 308:
+		n = sscanf(arg, "%lf,%lf", &args->limit.global_rate, &args->limit.global_burst);
+		if (n < 1 || args->limit.global_rate <= 0) {
+			argp_error(state, "Global limit takes requests/s[,burst]");
+		}
+		if (n < 2) args->limit.global_burst = args->limit.global_rate / 100;
+		break;
+	case 309:
+		args->limit.sources = atoi(arg);
+		if (args->limit.sources < 1) {
+			argp_error(state, "The source table needs at least 1 slot");
+		}
+		break;
+	case 310:
+		args->limit_report = atoi(arg);
+		break;
+	case 311:
+		args->client_memory = atof(arg) * 1024 * 1024;
+		if (args->client_memory == 0) {
+			argp_error(state, "Client memory must be more than 0 MiB");
+		}
+		break;
+	case 312:
+		args->bench_clients = atol(arg);
+		if (args->bench_clients < 1) {
+			argp_error(state, "Benchmark needs at least 1 client");
+		}
+		break;
+	case 'w':
+		args->workers = atoi(arg);
+		if (args->workers < 1) {
+			argp_error(state, "Number of workers must be at least 1");
+		}
+		break;
 	default:
 		ret = ARGP_ERR_UNKNOWN;
 		break;
@@ -60,11 +172,29 @@ void server_parseopt(struct server_arguments *args, int argc, char *argv[]) {
 	//bzero(&args, sizeof(args));
 
     bzero(args, sizeof(*args));
+    args->impair.loss_bad = 1;
+    args->impair.limit = IMPAIR_DEFAULT_LIMIT;
+    args->limit.sources = LIMIT_DEFAULT_SOURCES;
 
 	struct argp_option options[] = {
 		{ "port", 'p', "port", 0, "The port to be used for the server" ,0},
 		{ "drop", 'd', "drop", 0, "Percentage chance that the server drops", 0},
         { "condensed", 'c', "condensed", OPTION_ARG_OPTIONAL , "Use condensed message format", 0},
+		{ "batch", 'b', 0, 0, "Receive and answer up to 64 TimeRequests per recvmmsg/sendmmsg", 0},
+		{ "workers", 'w', "workers", 0, "Serve from this many threads, each with its own SO_REUSEPORT socket and client shard", 0},
+		{ "rx-stamp", 301, "none|software|hardware", 0, "Take the server time from the kernel (SO_TIMESTAMPNS) or NIC (SO_TIMESTAMPING) receive stamp instead of reading the clock after recvfrom", 0},
+		{ "loss-ge", 302, "p,r[,bad[,good]]", 0, "Lose responses in bursts: a Gilbert-Elliott channel going bad with p% chance and good again with r% per response, losing bad% (100) of them in the bad state and good% (0) in the good state", 0},
+		{ "delay", 303, "ms[,jitter]", 0, "Hold every response back by ms milliseconds, give or take a uniformly distributed jitter", 0},
+		{ "duplicate", 304, "percent", 0, "Percentage of responses sent twice", 0},
+		{ "reorder", 305, "percent", 0, "Percentage of responses that skip the --delay and overtake the ones held back", 0},
+		{ "queue-limit", 306, "responses", 0, "Responses --delay may hold back at once before dropping more. 1000 by default", 0},
+		{ "limit", 307, "rate[,burst]", 0, "Answer each source address at most rate requests/s, in bursts of up to burst (a second's worth by default)", 0},
+		{ "global-limit", 308, "rate[,burst]", 0, "Answer at most rate requests/s in all, in bursts of up to burst (10 ms worth by default)", 0},
+		{ "limit-sources", 309, "slots", 0, "Source addresses --limit tracks at once, 8 bytes each. 65536 by default", 0},
+		{ "limit-report", 310, "seconds", 0, "Print the rate limiter's counters to stderr this often", 0},
+		{ "bench", 300, 0, 0, "Measure packets per second in single and batched mode, with and without --condensed, and exit", 0},
+		{ "client-memory", 311, "MiB", 0, "Cap the memory that tracking clients' sequence numbers may take, forgetting the least recently heard from first. No cap by default", 0},
+		{ "bench-clients", 312, "clients", 0, "Measure the time and memory it takes to track this many clients, and exit", 0},
 		{0}
 	};
 	struct argp argp_settings = { options, server_parser, 0, 0, 0, 0, 0 };
@@ -83,72 +213,418 @@ void server_parseopt(struct server_arguments *args, int argc, char *argv[]) {
  
 
 
-Node *update_clients(Node *head, char *addr, char *port, int new_seq, time_t cur_time)
+// Track the client's sequence numbers and report one that went backwards.
+// Addresses are only turned into strings for the report.
+void update_clients(struct client_table *clients, const struct sockaddr_storage *addr,
+                    uint32_t new_seq, time_t cur_time)
+{
+    struct client_key key;
+    uint32_t latest;
+
+    client_key_from(&key, addr);
+    int rc = client_table_update(clients, &key, new_seq, cur_time, &latest);
+    if(rc < 0){
+        fprintf(stderr, "Out of memory tracking clients\n");
+    }else if(rc > 0){
+        char client_addr_info[NI_MAXHOST] = {0};
+        char client_port_info[NI_MAXSERV] = {0};
+        getnameinfo((const struct sockaddr *)addr, sizeof(*addr), client_addr_info, sizeof(client_addr_info),
+                    client_port_info, sizeof(client_port_info), NI_NUMERICHOST | NI_NUMERICSERV);
+        printf("%s:%s %d %d\n", client_addr_info, client_port_info, new_seq, latest);
+    }
+}
+
+// Parse the TimeRequest in buffer and write its TimeResponse, stamped with
+// tspec, into out. Returns the response length.
+size_t answer_request(const struct server_arguments *args, struct client_table *clients,
+                      const uint8_t *buffer, const struct sockaddr_storage *client_addr,
+                      const struct timespec *tspec, uint8_t *out)
+{
+    struct time_message m;
+    wire_decode(buffer, &m, args->condensed, 0);
+
+    update_clients(clients, client_addr, m.seq, tspec->tv_sec);
+
+    m.version = TIME_VERSION;
+    m.server = *tspec;
+    return wire_encode(out, &m, args->condensed, 1);
+}
+
+int should_drop(const struct server_arguments *args, unsigned *seed)
+{
+    int random = (rand_r(seed)%(100+1));
+    return !(args->drop_percent == 0 || random > args->drop_percent);
+}
+
+// Server time for a received TimeRequest: its receive stamp when those are
+// on, otherwise the clock now
+void request_time(const struct server_arguments *args, struct msghdr *msg, struct timespec *tspec)
+{
+    if(args->rx_stamp == RX_STAMP_NONE || !rx_stamp_get(msg, tspec)){
+        clock_gettime(CLOCK_REALTIME, tspec);
+    }
+}
+
+uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Rate limit a request before any work goes into answering it. Returns 1
+// if it should be answered.
+int admit_request(struct worker *w, const struct sockaddr_storage *addr, uint64_t now)
+{
+    if(!w->limiter) return 1;
+
+    switch(rate_limiter_check(w->limiter, addr, now)){
+    case LIMIT_PASS:
+        atomic_fetch_add_explicit(&w->passed, 1, memory_order_relaxed);
+        return 1;
+    case LIMIT_SOURCE:
+        atomic_fetch_add_explicit(&w->over_source, 1, memory_order_relaxed);
+        return 0;
+    default:
+        atomic_fetch_add_explicit(&w->over_global, 1, memory_order_relaxed);
+        return 0;
+    }
+}
+
+// With impairments on, send the delayed responses that are due and wait
+// for a TimeRequest no longer than until the next one is. Returns 1 once
+// the socket is readable.
+int wait_for_request(struct worker *w)
 {
-    if(head == NULL){
-        Node *newnode = calloc(sizeof(Node), 1);
-        newnode->seq = new_seq;
-        newnode->next = NULL;
-        newnode->last_update = cur_time;
-        strcpy(newnode->addr, addr);
-        strcpy(newnode->port, port);
-        return newnode;
-    }
-    
-    Node *current = head;
-    Node *prev = NULL;
-    int flag = 0;
-
-    while(current != NULL)
-    {   
-        if(!strcmp(current->addr, addr) && !strcmp(current->port, port)){
-            flag = 1;
-            if(difftime(cur_time, current->last_update) >= 120){
-                current->seq = new_seq;
-                current->last_update = cur_time;
-            }else{
-                if(current->seq > new_seq){
-                    printf("%s:%s %d %d\n", current->addr, current->port, new_seq, current->seq);
-                }else{
-                    current->seq = new_seq;
-                    current->last_update = cur_time;
-                }
+    if(!w->impair.config) return 1;
+
+    int64_t wait = impair_flush(&w->impair, w->sock, monotonic_ns());
+    struct timespec timeout = { wait / 1000000000, wait % 1000000000 };
+    struct pollfd pfd = { w->sock, POLLIN, 0 };
+    return ppoll(&pfd, 1, wait < 0 ? NULL : &timeout, NULL) > 0;
+}
+
+void send_response(struct worker *w, const uint8_t *out, size_t len,
+                   const struct sockaddr_storage *addr, socklen_t addr_len)
+{
+    if(w->impair.config){
+        impair_sendto(&w->impair, w->sock, out, len, (const struct sockaddr *)addr, addr_len, monotonic_ns());
+    }else{
+        sendto(w->sock, out, len, 0, (const struct sockaddr *)addr, addr_len);
+    }
+}
+
+// One recvmsg/sendto pair per TimeRequest. Runs until *stop is set (and
+// the socket's receive timeout fires), forever if stop is NULL.
+void serve_single(struct worker *w, atomic_int *stop)
+{
+    const struct server_arguments *args = w->args;
+    int recv_buffer_len = wire_request_size(args->condensed);
+    while(!stop || !atomic_load(stop)){
+        struct sockaddr_storage client_addr; // Client address
+        // Set Length of client address structure (in-out parameter)
+        socklen_t client_addr_len = sizeof(client_addr);
+
+        // Block until receive message from a client
+        uint8_t buffer[TIME_REQUEST_SIZE]; // I/O buffer
+        uint8_t control[RX_STAMP_CONTROL_SIZE];
+        struct iovec iov = { buffer, recv_buffer_len };
+        struct msghdr msg = {
+            .msg_name = &client_addr,
+            .msg_namelen = client_addr_len,
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+        // Size of received message
+        if(!wait_for_request(w) || recvmsg(w->sock, &msg, 0) < 0) continue;
+        client_addr_len = msg.msg_namelen;
+
+        if(admit_request(w, &client_addr, w->limiter ? monotonic_ns() : 0) && !should_drop(args, &w->seed)){
+            struct timespec tspec;
+            request_time(args, &msg, &tspec);
+
+            uint8_t out[TIME_RESPONSE_SIZE];
+            size_t len = answer_request(args, &w->clients, buffer, &client_addr, &tspec, out);
+            send_response(w, out, len, &client_addr, client_addr_len);
+        }
+    }
+}
+
+// Receive, stamp and answer up to BATCH_SIZE TimeRequests per syscall pair.
+// Every buffer and header is set up once and reused.
+struct batch {
+    struct mmsghdr recv_msgs[BATCH_SIZE];
+    struct mmsghdr send_msgs[BATCH_SIZE];
+    struct iovec recv_iov[BATCH_SIZE];
+    struct iovec send_iov[BATCH_SIZE];
+    struct sockaddr_storage addrs[BATCH_SIZE];
+    uint8_t requests[BATCH_SIZE][TIME_REQUEST_SIZE];
+    uint8_t responses[BATCH_SIZE][TIME_RESPONSE_SIZE];
+    uint8_t control[BATCH_SIZE][RX_STAMP_CONTROL_SIZE];
+};
+
+void serve_batched(struct worker *w, atomic_int *stop)
+{
+    const struct server_arguments *args = w->args;
+    struct batch *b = calloc(1, sizeof(*b));
+    if(!b){
+        fprintf(stderr, "Error allocating batch buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    for(int i = 0; i < BATCH_SIZE; i++){
+        b->recv_iov[i].iov_base = b->requests[i];
+        b->recv_iov[i].iov_len = wire_request_size(args->condensed);
+        b->recv_msgs[i].msg_hdr.msg_iov = &b->recv_iov[i];
+        b->recv_msgs[i].msg_hdr.msg_iovlen = 1;
+        b->recv_msgs[i].msg_hdr.msg_name = &b->addrs[i];
+        b->recv_msgs[i].msg_hdr.msg_control = b->control[i];
+        b->send_msgs[i].msg_hdr.msg_iov = &b->send_iov[i];
+        b->send_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while(!stop || !atomic_load(stop)){
+        for(int i = 0; i < BATCH_SIZE; i++){
+            b->recv_msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+            b->recv_msgs[i].msg_hdr.msg_controllen = sizeof(b->control[i]);
+        }
+
+        // Block for the first datagram, then take whatever else is queued
+        if(!wait_for_request(w)) continue;
+        int n = recvmmsg(w->sock, b->recv_msgs, BATCH_SIZE, MSG_WAITFORONE, NULL);
+        if(n <= 0) continue;
+
+        // Without receive stamps the whole batch arrived by now and one
+        // clock read serves it
+        struct timespec now, tspec;
+        clock_gettime(CLOCK_REALTIME, &now);
+        uint64_t arrival = w->limiter ? monotonic_ns() : 0;
+
+        int out = 0;
+        for(int i = 0; i < n; i++){
+            if(!admit_request(w, &b->addrs[i], arrival) || should_drop(args, &w->seed)) continue;
+
+            tspec = now;
+            if(args->rx_stamp != RX_STAMP_NONE) rx_stamp_get(&b->recv_msgs[i].msg_hdr, &tspec);
+
+            size_t len = answer_request(args, &w->clients, b->requests[i], &b->addrs[i], &tspec, b->responses[out]);
+            b->send_iov[out].iov_base = b->responses[out];
+            b->send_iov[out].iov_len = len;
+            b->send_msgs[out].msg_hdr.msg_name = &b->addrs[i];
+            b->send_msgs[out].msg_hdr.msg_namelen = b->recv_msgs[i].msg_hdr.msg_namelen;
+            out++;
+        }
+
+        if(w->impair.config){
+            for(int i = 0; i < out; i++){
+                send_response(w, b->responses[i], b->send_iov[i].iov_len,
+                              b->send_msgs[i].msg_hdr.msg_name, b->send_msgs[i].msg_hdr.msg_namelen);
             }
-        }else{
-            if(difftime(cur_time, current->last_update) >= 120){
-                current->seq = 0;
-                current->last_update = cur_time;
+            out = 0;
+        }
+        for(int sent = 0; sent < out; ){
+            int rc = sendmmsg(w->sock, b->send_msgs + sent, out - sent, 0);
+            if(rc < 0){
+                // UDP gives no delivery guarantee; drop the rest like a lost batch
+                break;
             }
+            sent += rc;
         }
-        prev = current ;
-        current = current -> next;
-    }
-    
-    if(!flag){;
-        Node *newnode = calloc(sizeof(Node), 1);
-        newnode->seq = new_seq;
-        newnode->next = NULL;
-        newnode->last_update = cur_time;
-        strcpy(newnode->addr, addr);
-        strcpy(newnode->port, port);
-        prev->next = newnode;
-    }
-    return head;
+    }
+    free(b);
 }
- 
-int main(int argc, char *argv[]){
 
+void serve(struct worker *w, atomic_int *stop)
+{
+    if(w->args->batch){
+        serve_batched(w, stop);
+    }else{
+        serve_single(w, stop);
+    }
+}
+
+
+// Load generator for the benchmark: keep BENCH_WINDOW TimeRequests in
+// flight from one socket, sent and received BATCH_SIZE at a time
+struct bench_load {
+    int sock;
+    int condensed;
+    uint64_t received;
+};
+
+void run_load(struct bench_load *load, double seconds)
+{
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iov[BATCH_SIZE];
+    uint8_t bufs[BATCH_SIZE][TIME_RESPONSE_SIZE];
+    struct time_message m = { 0, TIME_VERSION, { 0, 0 }, { 0, 0 } };
+    uint32_t seq = 0;
+    long inflight = 0;
+
+    memset(msgs, 0, sizeof(msgs));
+    for(int i = 0; i < BATCH_SIZE; i++){
+        iov[i].iov_base = bufs[i];
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do{
+        if(inflight + BATCH_SIZE <= BENCH_WINDOW){
+            for(int i = 0; i < BATCH_SIZE; i++){
+                m.seq = ++seq;
+                iov[i].iov_len = wire_encode(bufs[i], &m, load->condensed, 0);
+            }
+            int rc = sendmmsg(load->sock, msgs, BATCH_SIZE, 0);
+            if(rc > 0) inflight += rc;
+        }
+
+        for(int i = 0; i < BATCH_SIZE; i++){
+            iov[i].iov_len = TIME_RESPONSE_SIZE;
+        }
+        int rc = recvmmsg(load->sock, msgs, BATCH_SIZE, MSG_DONTWAIT, NULL);
+        if(rc > 0){
+            load->received += rc;
+            inflight -= rc;
+        }else if(inflight + BATCH_SIZE > BENCH_WINDOW){
+            // Anything still outstanding after a stall was dropped by the kernel
+            struct pollfd pfd = { load->sock, POLLIN, 0 };
+            if(poll(&pfd, 1, 10) == 0) inflight = 0;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }while((now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9 < seconds);
+}
+
+struct bench_server {
+    struct worker w;
     struct server_arguments args;
+    atomic_int stop;
+};
 
-    server_parseopt(&args, argc, argv);
+void *bench_serve(void *arg)
+{
+    struct bench_server *srv = arg;
+    serve(&srv->w, &srv->stop);
+    return NULL;
+}
 
-    if(args.port <= 1024){
-        fprintf(stderr, "You must use a port > 1024\n");
-        abort();
+// Answered TimeRequests per second over loopback, single and batched, in
+// both message formats
+void run_benchmark(void)
+{
+    printf("mode,condensed,pps\n");
+    for(int condensed = 0; condensed <= 1; condensed++){
+        for(int batched = 0; batched <= 1; batched++){
+            struct bench_server srv;
+            bzero(&srv, sizeof(srv));
+            srv.args.batch = batched;
+            srv.args.condensed = condensed;
+            srv.w.args = &srv.args;
+            srv.w.seed = 1;
+            atomic_init(&srv.stop, 0);
+            if(client_table_init(&srv.w.clients, 0) < 0){
+                fprintf(stderr, "Error allocating client table\n");
+                exit(EXIT_FAILURE);
+            }
+
+            struct sockaddr_in addr;
+            socklen_t addr_len = sizeof(addr);
+            bzero(&addr, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+            // Short receive timeout so the server notices the stop flag
+            struct timeval tv = { 0, 100000 };
+            struct bench_load load = { socket(AF_INET, SOCK_DGRAM, 0), condensed, 0 };
+            srv.w.sock = socket(AF_INET, SOCK_DGRAM, 0);
+            if(srv.w.sock < 0 || load.sock < 0
+               || bind(srv.w.sock, (struct sockaddr *)&addr, sizeof(addr)) < 0
+               || getsockname(srv.w.sock, (struct sockaddr *)&addr, &addr_len) < 0
+               || connect(load.sock, (struct sockaddr *)&addr, sizeof(addr)) < 0
+               || setsockopt(srv.w.sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0){
+                fprintf(stderr, "Benchmark socket setup failed\n");
+                exit(EXIT_FAILURE);
+            }
+
+            pthread_create(&srv.w.tid, NULL, bench_serve, &srv);
+            run_load(&load, BENCH_SECONDS);
+            atomic_store(&srv.stop, 1);
+            pthread_join(srv.w.tid, NULL);
+
+            printf("%s,%d,%.0f\n", batched ? "batched" : "single", condensed, load.received / (double)BENCH_SECONDS);
+            fflush(stdout);
+            close(srv.w.sock);
+            client_table_free(&srv.w.clients);
+            close(load.sock);
+        }
     }
+}
 
-    fprintf(stderr, "Got port %d and drop percent %d\n", args.port, args.drop_percent);
+long rss_kib(void)
+{
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if(f){
+        if(fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Track clients from count distinct addresses: each sends a first request
+// and then a second, in a scattered order as a real population would.
+// Reports the time per insert and per update and the memory it all took.
+void run_client_benchmark(const struct server_arguments *args, long count)
+{
+    struct client_table table;
+    long before = rss_kib();
+    if(client_table_init(&table, args->client_memory) < 0){
+        fprintf(stderr, "Error allocating client table\n");
+        exit(EXIT_FAILURE);
+    }
 
+    struct sockaddr_storage addr;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
+    struct client_key key;
+    bzero(&addr, sizeof(addr));
+    in6->sin6_family = AF_INET6;
+    time_t now = time(NULL);
+    uint32_t latest;
+    double ns[2];
+
+    for(uint32_t seq = 1; seq <= 2; seq++){
+        uint64_t start = monotonic_ns();
+        for(long n = 0; n < count; n++){
+            // 16 ports per address; the multiplier is prime, so this
+            // visits every client once
+            long i = seq == 1 ? n : (long)((n * 2654435761ull) % count);
+            uint32_t a = htonl(i / 16);
+            memcpy(&in6->sin6_addr.s6_addr[12], &a, 4);
+            in6->sin6_port = htons(1024 + i % 16);
+            client_key_from(&key, &addr);
+            if(client_table_update(&table, &key, seq, now, &latest) < 0){
+                fprintf(stderr, "Out of memory tracking clients\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        ns[seq - 1] = (monotonic_ns() - start) / (double)count;
+    }
+    long after = rss_kib();
+
+    printf("clients,insert_ns,update_ns,rss_kib,bytes_per_client,tracked,evictions\n");
+    printf("%ld,%.1f,%.1f,%ld,%.1f,%u,%lu\n", count, ns[0], ns[1], after - before,
+           (after - before) * 1024.0 / count, table.count, table.evictions);
+    client_table_free(&table);
+}
+
+// Create and bind the server's UDP socket. Workers each open their own on
+// the same port with SO_REUSEPORT; the kernel hashes every client's flow
+// to one of them, so a client's sequence numbers always reach the same
+// worker and shard.
+int open_socket(const struct server_arguments *args, int reuseport)
+{
     struct addrinfo addrCriteria; // Criteria for address
     memset(&addrCriteria, 0, sizeof(addrCriteria)); // Zero out structure
     addrCriteria.ai_family = AF_UNSPEC; // Any address family
@@ -158,104 +634,188 @@ int main(int argc, char *argv[]){
 
     struct addrinfo *serv_addr; // List of server addresses
     char port_str[1025] = {0};
-    sprintf(port_str, "%d", args.port);
+    sprintf(port_str, "%d", args->port);
     int rtnVal = getaddrinfo(NULL, port_str, &addrCriteria, &serv_addr);
-    if (rtnVal != 0)
+    if (rtnVal != 0) {
         fprintf(stderr, "getaddrinfo() failed\n");
+        return -1;
+    }
 
     // Create socket for incoming connections
     int sock = socket(serv_addr->ai_family, serv_addr->ai_socktype, serv_addr->ai_protocol);
-    if (sock < 0)
+    if (sock < 0) {
         fprintf(stderr, "socket() failed\n");
+        freeaddrinfo(serv_addr);
+        return -1;
+    }
+
+    int on = 1;
+    if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        fprintf(stderr, "SO_REUSEPORT failed\n");
+        close(sock);
+        freeaddrinfo(serv_addr);
+        return -1;
+    }
 
     // Bind to the local address
-    if (bind(sock, serv_addr->ai_addr, serv_addr->ai_addrlen) < 0)
+    if (bind(sock, serv_addr->ai_addr, serv_addr->ai_addrlen) < 0) {
         fprintf(stderr, "bind() failed\n");
+        close(sock);
+        freeaddrinfo(serv_addr);
+        return -1;
+    }
 
     // Free address list allocated by getaddrinfo()
     freeaddrinfo(serv_addr);
+    return sock;
+}
+
+struct limit_report {
+    struct worker *workers;
+    int count;
+    int interval;
+};
+
+// Print how many requests the limiter let through and turned away over
+// each interval, summed over the workers
+void *report_limits(void *arg)
+{
+    const struct limit_report *r = arg;
+    struct rate_limiter *limiter = r->workers[0].limiter;
+    uint64_t last[4] = {0};
 
-    srand(time(NULL));
-    Node *clients = NULL;
-    int recv_buffer_len = RECV_BUFFER_SIZE + (args.condensed ? -2 : 0);
-    int send_buffer_len = SEND_BUFFER_SIZE + (args.condensed ? -2 : 0);
     while(1){
-        struct sockaddr_storage client_addr; // Client address
-        // Set Length of client address structure (in-out parameter)
-        socklen_t client_addr_len = sizeof(client_addr);
+        sleep(r->interval);
+        uint64_t total[4] = {0};
+        for(int i = 0; i < r->count; i++){
+            total[0] += atomic_load_explicit(&r->workers[i].passed, memory_order_relaxed);
+            total[1] += atomic_load_explicit(&r->workers[i].over_source, memory_order_relaxed);
+            total[2] += atomic_load_explicit(&r->workers[i].over_global, memory_order_relaxed);
+        }
+        total[3] = atomic_load_explicit(&limiter->evictions, memory_order_relaxed);
+        fprintf(stderr, "limit: %lu passed, %lu over source limit, %lu over global limit, %lu evictions in %ds\n",
+                total[0] - last[0], total[1] - last[1], total[2] - last[2], total[3] - last[3], r->interval);
+        memcpy(last, total, sizeof(last));
+    }
+    return NULL;
+}
 
-        // Block until receive message from a client
-        uint8_t buffer[recv_buffer_len]; // I/O buffer
-        // Size of received message
-        recvfrom(sock, buffer, recv_buffer_len, 0, (struct sockaddr *) &client_addr, &client_addr_len); 
+// Set up the limiter the workers share, if any limits are configured, and
+// the thread reporting its counters
+void start_limits(const struct server_arguments *args, struct worker *workers, int count)
+{
+    if(!rate_limit_configured(&args->limit)) return;
 
-        int random = (rand()%(100+1));
-        
-        if(args.drop_percent == 0 || random > args.drop_percent){
-            struct timespec tspec;
-            clock_gettime(CLOCK_REALTIME,&tspec);
-            time_t serv_sec = tspec.tv_sec;
-            long serv_nanosec = tspec.tv_nsec;
-
-            socklen_t client_len = sizeof(struct sockaddr_storage);
-            char client_addr_info[NI_MAXHOST] ={0};
-            char client_port_info[NI_MAXSERV] ={0};
-            getnameinfo((struct sockaddr *)&client_addr, client_len, client_addr_info, sizeof(client_addr_info), client_port_info, sizeof(client_port_info), NI_NUMERICHOST | NI_NUMERICSERV);
-
-            uint32_t client_seq;
-            uint32_t client_ver;
-            uint64_t client_sec;
-            uint64_t client_nanosec;
-
-            if(args.condensed) {
-                memcpy(&client_seq, buffer, 4);
-                client_seq = ntohl(client_seq); 
-                memcpy(&client_ver, buffer+4, 2);
-                client_ver = ntohs(client_ver); 
-                memcpy(&client_sec, buffer+6, 8);
-                client_sec = be64toh(client_sec);
-                memcpy(&client_nanosec,buffer+14,  8);
-                client_nanosec = be64toh(client_nanosec);
-            } else {
-                memcpy(&client_seq, buffer, 4);
-                client_seq = ntohl(client_seq); 
-                memcpy(&client_ver, buffer+4, 4);
-                client_ver = ntohl(client_ver); 
-                memcpy(&client_sec, buffer+8, 8);
-                client_sec = be64toh(client_sec);
-                memcpy(&client_nanosec,buffer+16,  8);
-                client_nanosec = be64toh(client_nanosec);
-            }
+    struct rate_limiter *limiter = malloc(sizeof(*limiter));
+    if(!limiter || rate_limiter_init(limiter, &args->limit, monotonic_ns()) < 0){
+        fprintf(stderr, "Error allocating the rate limiter\n");
+        exit(EXIT_FAILURE);
+    }
+    for(int i = 0; i < count; i++){
+        workers[i].limiter = limiter;
+    }
 
-            
-            clients = update_clients(clients, client_addr_info, client_port_info, client_seq, serv_sec);
-
-            uint8_t buffer[SEND_BUFFER_SIZE + (args.condensed ? -2 : 0)];
-            client_seq = htonl(client_seq); 
-            client_sec = htobe64(client_sec);
-            client_nanosec = htobe64(client_nanosec);
-            uint64_t serv_sec_nb = htobe64(serv_sec);
-            uint64_t serv_nanosec_nb = htobe64(serv_nanosec);
-
-            if(args.condensed) {
-                uint16_t ver = htons(7);
-                memcpy(buffer, &client_seq, 4);
-                memcpy(buffer+4, &ver, 2);
-                memcpy(buffer+6, &client_sec, 8);
-                memcpy(buffer+14, &client_nanosec, 8);
-                memcpy(buffer+22, &serv_sec_nb, 8);
-                memcpy(buffer+30, &serv_nanosec_nb, 8);
-            } else {
-                uint32_t ver = htonl(7);
-                memcpy(buffer, &client_seq, 4);
-                memcpy(buffer+4, &ver, 4);
-                memcpy(buffer+8, &client_sec, 8);
-                memcpy(buffer+16, &client_nanosec, 8);
-                memcpy(buffer+24, &serv_sec_nb, 8);
-                memcpy(buffer+32, &serv_nanosec_nb, 8);
-            }
-            sendto(sock, buffer, send_buffer_len, 0, (struct sockaddr *) &client_addr, sizeof(client_addr));
-           
+    if(args->limit_report > 0){
+        static struct limit_report report;
+        report = (struct limit_report){ workers, count, args->limit_report };
+        pthread_t tid;
+        if(pthread_create(&tid, NULL, report_limits, &report) != 0){
+            fprintf(stderr, "pthread_create() failed\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(tid);
+    }
+}
+
+void *worker_main(void *arg)
+{
+    serve(arg, NULL);
+    return NULL;
+}
+
+void run_workers(const struct server_arguments *args)
+{
+    struct worker *workers = calloc(args->workers, sizeof(*workers));
+    if(!workers){
+        fprintf(stderr, "Error allocating workers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Every socket is bound before any worker starts, so no flow is hashed
+    // to a group that is still growing
+    for(int i = 0; i < args->workers; i++){
+        workers[i].args = args;
+        workers[i].seed = time(NULL) + i;
+        if((workers[i].sock = open_socket(args, 1)) < 0 || rx_stamp_enable(workers[i].sock, args->rx_stamp) < 0
+           || client_table_init(&workers[i].clients, args->client_memory / args->workers) < 0
+           || (impair_configured(&args->impair) && impair_init(&workers[i].impair, &args->impair, workers[i].seed) < 0)){
+            fprintf(stderr, "Error setting up worker %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    start_limits(args, workers, args->workers);
+    for(int i = 0; i < args->workers; i++){
+        if(pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]) != 0){
+            fprintf(stderr, "pthread_create() failed\n");
+            exit(EXIT_FAILURE);
         }
     }
-}
\ No newline at end of file
+    fprintf(stderr, "Serving with %d workers\n", args->workers);
+
+    for(int i = 0; i < args->workers; i++){
+        pthread_join(workers[i].tid, NULL);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char *argv[]){
+
+    struct server_arguments args;
+
+    server_parseopt(&args, argc, argv);
+
+    if(args.bench){
+        run_benchmark();
+        return 0;
+    }
+    if(args.bench_clients){
+        run_client_benchmark(&args, args.bench_clients);
+        return 0;
+    }
+
+    if(args.port <= 1024){
+        fprintf(stderr, "You must use a port > 1024\n");
+        abort();
+    }
+
+    fprintf(stderr, "Got port %d and drop percent %d\n", args.port, args.drop_percent);
+    if(impair_configured(&args.impair)){
+        const struct impair_config *c = &args.impair;
+        fprintf(stderr, "Impairing responses: loss p=%g%% r=%g%% bad=%g%% good=%g%%, delay %g+/-%g ms, duplicate %g%%, reorder %g%%\n",
+                c->ge_p * 100, c->ge_r * 100, c->loss_bad * 100, c->loss_good * 100, c->delay * 1000, c->jitter * 1000,
+                c->duplicate * 100, c->reorder * 100);
+    }
+
+    if(args.workers){
+        run_workers(&args);
+    }
+
+    struct worker w;
+    bzero(&w, sizeof(w));
+    w.args = &args;
+    w.seed = time(NULL);
+    if((w.sock = open_socket(&args, 0)) < 0 || rx_stamp_enable(w.sock, args.rx_stamp) < 0){
+        exit(EXIT_FAILURE);
+    }
+    if(client_table_init(&w.clients, args.client_memory) < 0){
+        fprintf(stderr, "Error allocating client table\n");
+        exit(EXIT_FAILURE);
+    }
+    if(impair_configured(&args.impair) && impair_init(&w.impair, &args.impair, w.seed) < 0){
+        fprintf(stderr, "Error allocating the impairment queue\n");
+        exit(EXIT_FAILURE);
+    }
+    start_limits(&args, &w, 1);
+
+    serve(&w, NULL);
+}
@@ -0,0 +1,103 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <argp.h>
+
+#include "wire.h"
+
+// Times the TimeRequest/TimeResponse codec on its own, without sockets:
+// encoding and decoding each message kind in both formats, as the client
+// and the server do once per request. Prints CSV of format,op,ns per call.
+
+#define DEFAULT_ROUNDS 10000000
+
+struct bench_arguments {
+    long rounds;
+};
+
+error_t bench_parser(int key, char *arg, struct argp_state *state) {
+	struct bench_arguments *args = state->input;
+	switch(key) {
+	case 'n':
+		args->rounds = atol(arg);
+		if (args->rounds < 1) {
+			argp_error(state, "Rounds must be at least 1");
+		}
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+// Keeps the compiler from dropping the work being timed
+static volatile uint64_t sink;
+
+static double elapsed_ns(const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+static void bench_format(int condensed, long rounds)
+{
+    const char *format = condensed ? "condensed" : "standard";
+    uint8_t request[TIME_REQUEST_SIZE], response[TIME_RESPONSE_SIZE];
+    struct time_message m = { 1, TIME_VERSION, { 1700000000, 0 }, { 1700000000, 500 } };
+    struct timespec start;
+    uint64_t acc = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(long i = 0; i < rounds; i++){
+        m.seq = i;
+        acc += wire_encode(request, &m, condensed, 0) + request[3];
+    }
+    printf("%s,encode_request,%.2f\n", format, elapsed_ns(&start) / rounds);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(long i = 0; i < rounds; i++){
+        request[3] = i;
+        wire_decode(request, &m, condensed, 0);
+        acc += m.seq + m.client.tv_nsec;
+    }
+    printf("%s,decode_request,%.2f\n", format, elapsed_ns(&start) / rounds);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(long i = 0; i < rounds; i++){
+        m.server.tv_nsec = i;
+        acc += wire_encode(response, &m, condensed, 1) + response[wire_response_size(condensed) - 1];
+    }
+    printf("%s,encode_response,%.2f\n", format, elapsed_ns(&start) / rounds);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(long i = 0; i < rounds; i++){
+        response[3] = i;
+        wire_decode(response, &m, condensed, 1);
+        acc += m.seq + m.server.tv_nsec;
+    }
+    printf("%s,decode_response,%.2f\n", format, elapsed_ns(&start) / rounds);
+
+    sink = acc;
+}
+
+int main(int argc, char *argv[])
+{
+    struct argp_option options[] = {
+        { "rounds", 'n', "rounds", 0, "Calls to time for each operation", 0},
+        {0}
+    };
+    struct argp argp_settings = { options, bench_parser, 0, 0, 0, 0, 0 };
+    struct bench_arguments args = { DEFAULT_ROUNDS };
+    if (argp_parse(&argp_settings, argc, argv, 0, NULL, &args) != 0) {
+        printf("Got an error condition when parsing\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("format,op,ns\n");
+    bench_format(0, args.rounds);
+    bench_format(1, args.rounds);
+    return EXIT_SUCCESS;
+}
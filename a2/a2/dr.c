@@ -12,6 +12,7 @@
 #include "dv.h"
 #include "rt.h"
 #include "ls.h"
+#include "sim.h"
 
 long alloc_read(char **s, char *fname);
 void usage(char *err_msg, char *name);
@@ -24,8 +25,9 @@ char *sc_file;
 extern int ruparse();
 extern struct el *g_lst;
 
-unsigned int pupdate_interval = 3;
-unsigned int evset_interval = 30;
+// ms; given in (possibly fractional) seconds on the command line
+unsigned int pupdate_interval = 3000;
+unsigned int evset_interval = 30000;
 unsigned int verbose = 0;
 // FILE *ConfigFile;
 
@@ -38,6 +40,13 @@ int main(int argc, char *argv[])
 	parser_init(sc_file);
 	ruparse();
 
+	// or run every node of the config right here
+	if (g_sim)
+	{
+		sim_run(pupdate_interval, evset_interval, verbose);
+		return 0;
+	}
+
 	// initialize link set and routing table
 	init_global_structures();
 
@@ -90,6 +99,7 @@ void parser_init(char *sc_file)
 
 /*[]------------------------------------------------------------------[]
   [] dr -n <my_node_id> -f <config_file>
+  [] dr -s -f <config_file>
   []------------------------------------------------------------------[]*/
 extern char *optarg;
 extern int opterr, optind, optopt;
@@ -102,7 +112,7 @@ int parse_arg(int argc, char **argv)
 
 	/* to turn off default report of illegal option, uncomment the next line */
 	/* opterr = 0; */
-	while ((opt_char = getopt(argc, argv, "n:f:u:t:v")) != EOF)
+	while ((opt_char = getopt(argc, argv, "n:f:u:t:vs")) != EOF)
 	{
 		switch (opt_char)
 		{
@@ -115,15 +125,18 @@ int parse_arg(int argc, char **argv)
 			got_config = true;
 			break;
 		case 'u':
-			pupdate_interval = atoi(optarg);
+			pupdate_interval = atof(optarg) * 1000;
 			break;
 		case 't':
-			evset_interval = atoi(optarg);
+			evset_interval = atof(optarg) * 1000;
 			break;
 		case 'v':
 			// verbose = atoi(optarg);
 			verbose = 1;
 			break;
+		case 's':
+			g_sim = true;
+			break;
 		case '?':
 			usage("", argv[0]);
 			break;
@@ -132,7 +145,7 @@ int parse_arg(int argc, char **argv)
 	if (optind != argc)
 		usage("", argv[0]);
 
-	if (!got_myid)
+	if (!got_myid && !g_sim)
 		usage("", argv[0]);
 
 	if (!got_config)
@@ -155,7 +168,8 @@ void init_global_structures()
   []------------------------------------------------------------------[]*/
 void usage(char *err_msg, char *name)
 {
-	fprintf(stderr, "\n%s\nUsage: %s -n <my_node_id> [-f <config_file>] [-u periodic_update_interval] [-t event_set_execute_interval] [-v]\n",
-			err_msg, name);
+	fprintf(stderr, "\n%s\nUsage: %s -n <my_node_id> [-f <config_file>] [-u periodic_update_interval] [-t event_set_execute_interval] [-v]\n"
+					"       %s -s [-f <config_file>] [-u periodic_update_interval] [-t event_set_execute_interval] [-v]\n",
+			err_msg, name, name);
 	exit(1);
 }
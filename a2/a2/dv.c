@@ -1,26 +1,44 @@
 #include <assert.h>
 #include <stdio.h>
-#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <netdb.h>
-#include <time.h>
+#include <sys/epoll.h>
 
 #include "dv.h"
 #include "es.h"
 #include "ls.h"
 #include "rt.h"
 #include "n2h.h"
+#include "tm.h"
+#include "sim.h"
 
-#define MAX_NODES 256
-#define MAX_BUFFER_LEN 1024
+#define TRIGGER_HOLDDOWN_MS 100 // changes are collected this long before going out
+#define ROUTE_TIMEOUT_PERIODS 6 // a learned route not heard of again this long is lost
+#define ROUTE_HOLDDOWN_PERIODS 1 // a lost route ignores other neighbors this long
+#define MAX_EVENTS 64
+#define MAX_READS 64 // datagrams read from one link per wakeup
 
 // global variables
 // you may want to take a look at each header files (es.h, ls.h, rt.h)
 // to learn about what information and helper functions are already available to you
 extern struct el *g_lst;  // 2-D linked list of parsed event config file
 extern struct link *g_ls; // current host's link state storage
-extern struct rte *g_rt;  // current host's routing table
+extern int g_ls_ep;       // epoll set of the link sockets
+
+static struct dv_state g_dv0;
+struct dv_state *g_dv = &g_dv0;
+struct dv_stats g_dv_stats;
+bool dv_trace = true;
+static int g_pupdate = 0;        // ms between periodic updates, 0 until they start
+
+static void trace_rte(struct rte *i) {
+	if(dv_trace) print_rte(i);
+}
 
 // this function is our "entrypoint" to processing "list of [event set]s"
+// intervals are in milliseconds
 void walk_event_set_list(int pupdate_interval, int evset_interval, int verbose)
 {
 	struct el *es; // event set, as an element of the global list
@@ -88,50 +106,90 @@ void process_event_set(struct el *es)
 	}
 }
 
-int set_packet(uint8_t *buffer) {
-	struct rte *i;
-	uint16_t counter = 0;
-	uint8_t type = 0x7;
-	uint8_t version = 0x1;
-	memcpy(buffer, &type, 1);
-	memcpy(buffer +1, &version, 1);
-
-	for(i = g_rt->next; i != g_rt; i = i->next) {
-		uint16_t dest = htons(i->d);
-		memcpy(buffer + (counter +1) *4, &dest, 2);
-		uint16_t cost_value = htons(i->c);
-		memcpy(buffer + (counter +1) *4 +2, &cost_value, 2);
-		counter++;
-	}
-
-	uint16_t counter_n = htons(counter);
-	memcpy(buffer+2, &counter_n, 2);
-
-	return counter;
+// Vectors go out in fragments, each filling a datagram up to the link's
+// path MTU. A fragment is
+//   type(1) version(1) count(2) seq(2) frag(2) nfrags(2) reserved(2)
+// and count entries of dest(2) cost(2), all in network byte order. The
+// fragments of one vector share seq and are applied once all have arrived.
+#define DV_TYPE 0x7
+#define DV_VERSION 0x2
+#define DV_HEADER_LEN 12
+#define DV_ENTRY_LEN 4
+#define UDP_IP_HEADER_LEN 28
+#define MIN_MTU 576
+#define MAX_DATAGRAM 65535
+
+static uint8_t *tx_buf = 0x0; // fragment being filled
+static size_t tx_cap = 0;
+
+// with changed_only, only routes changed since the last update that were
+// not learned from peer
+static bool route_wanted(struct rte *i, node peer, bool changed_only) {
+	return !changed_only || (i->dirty && i->from != peer);
 }
 
-void send_to_neighbor(struct link *l) {
-	node curr_host = get_myid();
-	node node_to_send;
-	int port_to_send = l->peer_port;
-
-	struct sockaddr_in server_addr;
+static void put16(uint8_t *p, uint16_t v) {
+	v = htons(v);
+	memcpy(p, &v, 2);
+}
 
-	memset(&server_addr, 0, sizeof(server_addr));
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_addr = getaddrbyhost(gethostbynode(l->peer));
-	server_addr.sin_port = htons(port_to_send);
+static uint16_t get16(const uint8_t *p) {
+	uint16_t v;
+	memcpy(&v, p, 2);
+	return ntohs(v);
+}
 
-	uint8_t buffer[1024] = {0};
-	int entry_count = set_packet(buffer);
-	int size = (entry_count + 1) * 4;
+void send_to_neighbor(struct link *l, bool changed_only) {
+	struct rte *i;
+	int mtu = l->mtu < MIN_MTU ? MIN_MTU : l->mtu;
+	size_t payload = mtu - UDP_IP_HEADER_LEN;
+	if(payload > MAX_DATAGRAM - UDP_IP_HEADER_LEN) payload = MAX_DATAGRAM - UDP_IP_HEADER_LEN;
+	int per_frag = (payload - DV_HEADER_LEN) / DV_ENTRY_LEN;
+
+	int entries = 0;
+	FOR_EACH_RTE(i) {
+		if(route_wanted(i, l->peer, changed_only)) entries++;
+	}
+	if(changed_only && entries == 0) return;
+	int nfrags = entries ? (entries + per_frag - 1) / per_frag : 1;
 
-	// for(int n = 0; n<size; n++)
-	// 	printf("%02x", buffer[n]);	
-	//printf("\n");
+	if(tx_cap < payload) {
+		tx_buf = (uint8_t *)realloc(tx_buf, payload);
+		assert(tx_buf);
+		tx_cap = payload;
+	}
 
-	sendto(l->sockfd, buffer, size, 0, (const struct sockaddr *)&server_addr, sizeof(server_addr));
+	uint16_t seq = l->seq++;
+	i = rt_first();
+	for(int frag = 0; frag < nfrags; frag++) {
+		int count = 0;
+		for(; i && count < per_frag; i = rt_next(i)) {
+			if(!route_wanted(i, l->peer, changed_only)) continue;
+
+			uint8_t *e = tx_buf + DV_HEADER_LEN + count * DV_ENTRY_LEN;
+			put16(e, i->d);
+			put16(e + 2, i->c);
+			count++;
+		}
 
+		tx_buf[0] = DV_TYPE;
+		tx_buf[1] = DV_VERSION;
+		put16(tx_buf + 2, count);
+		put16(tx_buf + 4, seq);
+		put16(tx_buf + 6, frag);
+		put16(tx_buf + 8, nfrags);
+		put16(tx_buf + 10, 0);
+
+		size_t len = DV_HEADER_LEN + count * DV_ENTRY_LEN;
+		if(g_sim) {
+			sim_send(l->peer, tx_buf, len);
+		} else {
+			sendto(l->sockfd, tx_buf, len, 0,
+				   (const struct sockaddr *)&l->peer_addr, sizeof(l->peer_addr));
+		}
+		g_dv_stats.msgs++;
+		g_dv_stats.bytes += len;
+	}
 }
 
 void send_all_neighbors() { //) {
@@ -143,24 +201,28 @@ void send_all_neighbors() { //) {
 	for(struct link *l = g_ls->next; l != g_ls; l = l->next) {
 		assert(l);
 
-		send_to_neighbor(l);
+		send_to_neighbor(l, false);
 	}
 
 }
 
-void send_all_neighbors_except(node n) { //) {
-	//node curr_host = get_myid();
-	// if(curr_host != ev->peer0 && curr_host != ev->peer1) {
-	// 	return;
-	// }
+// send what changed once the hold-down runs out, so a burst of changes
+// goes out as one update. Called on every route change.
+void schedule_triggered_update() {
+	g_dv_stats.changes++;
+	g_dv_stats.last_change = tm_now();
+	if(g_dv->trigger_at == 0) {
+		g_dv->trigger_at = tm_now() + TRIGGER_HOLDDOWN_MS;
+		tm_add(g_dv->trigger_at, _tm_trigger, 0);
+	}
+}
 
+void send_triggered_updates() {
 	for(struct link *l = g_ls->next; l != g_ls; l = l->next) {
-		assert(l);
-
-		//send_to_neighbor(l);
-		if(l->peer != n) send_to_neighbor(l);
+		send_to_neighbor(l, true);
 	}
-
+	rt_clear_dirty();
+	g_dv->trigger_at = 0;
 }
 
 struct link *find_link_by_peer(node peer) {
@@ -176,7 +238,7 @@ struct link *find_link_by_peer(node peer) {
 struct rte *find_rte_by_nh(node n) {
 	struct rte *i;
 
-	for (i = g_rt->next; i != g_rt; i = i->next)
+	FOR_EACH_RTE(i)
 	{
 		if (i->nh == n)
 			return i;
@@ -185,6 +247,166 @@ struct rte *find_rte_by_nh(node n) {
 
 }
 
+// a route learned from a neighbor lasts while the neighbor keeps advertising it
+static void refresh_route(struct rte *r) {
+	r->expires = tm_now() + ROUTE_TIMEOUT_PERIODS * g_pupdate;
+	if(!r->timed) {
+		r->timed = true;
+		tm_add(r->expires, _tm_route, r->d);
+	}
+}
+
+// the route to n is gone: fall back to a direct link, or hold the route
+// down as unreachable so stale news of it from elsewhere is not taken
+static void lose_route(node n, node from) {
+	struct rte *r = find_rte(n);
+	struct link *l = find_link_by_peer(n);
+
+	if(l == 0x0) {
+		update_rte_from(n, -1, n, from);
+		r->held = tm_now() + ROUTE_HOLDDOWN_PERIODS * g_pupdate;
+	} else { 
+		update_rte_from(n, l->c, n, from);
+	}
+	r->expires = 0;
+	trace_rte(r);
+	schedule_triggered_update();
+}
+
+static void route_timer(node n) {
+	struct rte *r = find_rte(n);
+	if(!r) return;
+
+	r->timed = false;
+	if(r->expires == 0) return;
+	if(r->expires > tm_now()) {
+		r->timed = true;
+		tm_add(r->expires, _tm_route, n);
+		return;
+	}
+	if(dv_trace) printf("[rt]\tRoute to node %d timed out\n", n);
+	lose_route(n, NO_NODE);
+}
+
+// apply one entry of a neighbor's vector
+static void apply_entry(node neighbor_node, node dest, uint16_t min_cost) {
+	if(get_myid() == dest) return;
+
+	// the first hop is the link to the neighbor, whatever the best route to it is
+	struct rte *d_v = find_rte(dest);
+	struct link *x = find_link_by_peer(neighbor_node);
+	if(!d_v || !x) return;
+	cost via = x->c + min_cost;
+
+	if((int16_t)min_cost == -1) {
+		// only routes through the neighbor are lost with it
+		if(d_v->nh != neighbor_node || d_v->c == (cost)-1) return;
+
+		lose_route(dest, neighbor_node);
+	} else {
+		if(d_v->c == (cost)-1 && d_v->held > tm_now()) return;
+		if(d_v->nh == neighbor_node && d_v->nh != dest) refresh_route(d_v);
+
+		int cost_updated = 0;
+		if(via != d_v->c && d_v->c != (cost)-1 && d_v->nh == neighbor_node) {
+			cost_updated = 1;
+		}
+		// a worse route through the next hop may now lose to a direct link.
+		// Updates only carry changes, so nothing else would bring the link back.
+		struct link *direct = find_link_by_peer(dest);
+		if(cost_updated == 1 && direct && direct->c <= via) {
+			update_rte_from(dest, direct->c, dest, neighbor_node);
+			d_v->expires = 0;
+			trace_rte(find_rte(dest));
+			schedule_triggered_update();
+		} else if(via < d_v->c || d_v->c == (cost)-1 || cost_updated == 1)  {
+			update_rte_from(dest, via, neighbor_node, neighbor_node);
+			refresh_route(d_v);
+			trace_rte(find_rte(dest));
+			schedule_triggered_update();
+		}
+	}
+}
+
+static void apply_entries(node neighbor_node, const uint8_t *e, int count) {
+	for(int u = 0; u < count; u++, e += DV_ENTRY_LEN) {
+		apply_entry(neighbor_node, get16(e), get16(e + 2));
+	}
+}
+
+static uint8_t *rx_buf = 0x0; // one datagram
+
+// receive one fragment over l. Returns false once there is nothing left to read.
+static bool receive_vector(struct link *l) {
+	if(!rx_buf) {
+		rx_buf = (uint8_t *)malloc(MAX_DATAGRAM);
+		assert(rx_buf);
+	}
+
+	ssize_t n = recvfrom(l->sockfd, rx_buf, MAX_DATAGRAM, MSG_DONTWAIT, 0x0, 0x0);
+	if(n < 0) return errno == EINTR;
+	dv_receive(l, rx_buf, n);
+	return true;
+}
+
+// a fragment from the peer of l; the vector is applied once it is whole.
+// A new link numbers its vectors from 0 again, and starts with l->rx zeroed.
+void dv_receive(struct link *l, const uint8_t *buf, ssize_t n) {
+	node neighbor_node = l->peer;
+	if(n < DV_HEADER_LEN || buf[0] != DV_TYPE || buf[1] != DV_VERSION) return;
+
+	uint16_t count = get16(buf + 2);
+	uint16_t seq = get16(buf + 4);
+	uint16_t frag = get16(buf + 6);
+	uint16_t nfrags = get16(buf + 8);
+	if(frag >= nfrags || DV_HEADER_LEN + count * DV_ENTRY_LEN > n) return;
+
+	struct reassembly *r = &l->rx;
+	if(r->started && (int16_t)(seq - r->seq) < 0) return; // older vector
+	if(r->started && seq == r->seq && (r->complete || nfrags != r->nfrags)) return;
+
+	if(nfrags == 1) {
+		r->started = r->complete = true;
+		r->seq = seq;
+		apply_entries(neighbor_node, buf + DV_HEADER_LEN, count);
+		return;
+	}
+
+	if(!r->started || seq != r->seq) {
+		// entries stand alone, so whatever made it of a superseded vector
+		// still counts
+		if(r->started && !r->complete && r->len > 0) {
+			apply_entries(neighbor_node, r->entries, r->len / DV_ENTRY_LEN);
+		}
+		r->started = true;
+		r->complete = false;
+		r->seq = seq;
+		r->nfrags = nfrags;
+		r->got = 0;
+		r->len = 0;
+		r->seen = (uint8_t *)realloc(r->seen, nfrags);
+		assert(r->seen);
+		memset(r->seen, 0, nfrags);
+	}
+	if(r->seen[frag]) return;
+	r->seen[frag] = 1;
+	r->got++;
+
+	size_t len = count * DV_ENTRY_LEN;
+	if(r->len + len > r->cap) {
+		r->cap = (r->len + len) * 2;
+		r->entries = (uint8_t *)realloc(r->entries, r->cap);
+		assert(r->entries);
+	}
+	memcpy(r->entries + r->len, buf + DV_HEADER_LEN, len);
+	r->len += len;
+
+	if(r->got == r->nfrags) {
+		r->complete = true;
+		apply_entries(neighbor_node, r->entries, r->len / DV_ENTRY_LEN);
+	}
+}
+
 // dispatch a event, update data structures, and
 // TODO: send link updates to current host's direct neighbors
 void dispatch_single_event(struct es *ev)
@@ -197,24 +419,25 @@ void dispatch_single_event(struct es *ev)
 	// if yes, propagate updates to your direct neighbors
 	// you might want to add your own helper that handles sending to neighbors
 
-	print_event(ev);
+	if(dv_trace) print_event(ev);
 
 	switch (ev->ev_ty)
 	{
 	case _es_link:
 		//print_event(ev);
 
-		add_link_if_local(ev->peer0, ev->port0, ev->peer1, ev->port1, ev->cost, ev->name);
+		if(add_link_if_local(ev->peer0, ev->port0, ev->peer1, ev->port1, ev->cost, ev->name) != 1) break;
 		if(ev->peer1 == get_myid()) {
 			update_rte(ev->peer0, ev->cost, ev->peer0);
-			print_rte(find_rte(ev->peer0));
+			trace_rte(find_rte(ev->peer0));
 		} else {
 			update_rte(ev->peer1, ev->cost, ev->peer1);
-			print_rte(find_rte(ev->peer1));
+			trace_rte(find_rte(ev->peer1));
 		}
 		
-		//l = find_link(ev->name);
-		send_all_neighbors();
+		// a new neighbor gets the whole table, the rest what changed
+		send_to_neighbor(find_link(ev->name), false);
+		schedule_triggered_update();
 		
 		break;
 	case _ud_link:
@@ -226,14 +449,13 @@ void dispatch_single_event(struct es *ev)
 
 		if(up_es->peer1 == get_myid()) {
 			update_rte(up_es->peer0, ev->cost, up_es->peer0);
-			print_rte(find_rte(ev->peer0));	
+			trace_rte(find_rte(up_es->peer0));	
 		} else {
 			update_rte(up_es->peer1, ev->cost, up_es->peer1);
-			print_rte(find_rte(ev->peer1));
+			trace_rte(find_rte(up_es->peer1));
 		}
 
-		//l = find_link(ev->name);
-		send_all_neighbors();
+		schedule_triggered_update();
 
 		ud_link(ev->name, ev->cost);
 
@@ -252,22 +474,19 @@ void dispatch_single_event(struct es *ev)
 			peer = del_es->peer1;
 		}
 
-		update_rte(peer, -1, peer);
-		print_rte(find_rte(peer));
+		// with the link gone, routes through the peer can only fall back to other links
+		del_link(del_es->name);
+
+		lose_route(peer, NO_NODE);
 
-		for (struct rte *e = g_rt->next; e != g_rt; e = e->next)
+		struct rte *e;
+		FOR_EACH_RTE(e)
 		{
-			if (e->nh == peer) {
-				update_rte(e->d, -1, e->d);
-				print_rte(e);
+			if (e->nh == peer && e->c != (cost)-1) {
+				lose_route(e->d, NO_NODE);
 			}
 		}
 
-		//l = find_link(del_es->name);
-		send_all_neighbors();
-
-		del_link(del_es->name);
-
 		break;
 	default:
 		printf("[es]\t\tUnknown event!\n");
@@ -276,7 +495,7 @@ void dispatch_single_event(struct es *ev)
 
 }
 
-// this function should execute for `evset_interval` seconds
+// this function should execute for `evset_interval` milliseconds
 // it will recv updates from neighbors, update the routing table, and send updates back
 // it should also handle sending periodic updates to neighbors
 // TODO: implement this function; pseudocode has been provided below for your reference
@@ -303,115 +522,79 @@ void dv_process_updates(int pupdate_interval, int evset_interval)
 	//     (HINT: which one comes early? next periodic update or next event set execution?)
 	//     make sure that the whole function don't block for longer than `evset_interval` seconds!
 
-	time_t t0 = time(NULL);
-
-	int timeout_sec = pupdate_interval;
-
-	node nodes[MAX_NODES];
-	int socket_counter = 0;
-	struct pollfd sockets[MAX_NODES] = {0};
-
-	for(struct link *l = g_ls->next; l != g_ls; l = l->next) {
-		if(l->sockfd != -1) {
-			sockets[socket_counter].fd = l->sockfd;
-			sockets[socket_counter].events = POLLIN;
-			nodes[socket_counter] = l->peer;
-
-			socket_counter++;
-		}
+	g_pupdate = pupdate_interval;
 
+	// periodic updates keep their pace across event sets
+	static bool periodic_started = false;
+	if(!periodic_started) {
+		dv_start_periodic(pupdate_interval, tm_now() + pupdate_interval);
+		periodic_started = true;
 	}
-
-	int ready = 0;
-	int curr_host = get_myid();
-	while(1) {
-		ready = poll(sockets, socket_counter, timeout_sec *1000);
-		if(ready < 0) {
-			fprintf(stderr, "poll() error\n");
+	// with no event set left, run until the next periodic update
+	tm_add(tm_now() + (evset_interval ? evset_interval : pupdate_interval), _tm_evset, 0);
+
+	struct epoll_event events[MAX_EVENTS];
+	bool done = false;
+	while(!done) {
+		struct timer *t = tm_first();
+		long long now = tm_now();
+
+		int ready = epoll_wait(g_ls_ep, events, MAX_EVENTS, t->due > now ? (int)(t->due - now) : 0);
+		if(ready < 0 && errno != EINTR) {
+			fprintf(stderr, "epoll_wait() error\n");
 			exit(1);
-		} else if(ready == 0) {
-			fprintf(stderr, "poll() timeout\n");
-			send_periodic_updates();
-		} else {
-			for(int i = 0; i < socket_counter; i++) {
-				if(sockets[i].revents && POLLIN) { // socket available
-					//printf("[es] >>>>>>> if POLLIN <<<<<<<<<<<\n");
-					struct sockaddr_storage client_addr;
-					socklen_t client_addr_len = sizeof(client_addr);
-
-					uint8_t buffer[MAX_BUFFER_LEN] = {0};
-					int n = recvfrom(sockets[i].fd, buffer, MAX_BUFFER_LEN, MSG_WAITALL, (struct sockaddr *)&client_addr, &client_addr_len);
-
-					uint16_t num_updates;
-					memcpy(&num_updates, buffer+2, 2);
-					num_updates = ntohs(num_updates);
-
-					uint16_t dest = 0;
-					uint16_t min_cost = 0;
-					node neighbor_node = nodes[i];
-					for(int u = 0; u<num_updates; u++) {
-						memcpy(&dest, buffer +4 +4 *u, 2);
-						memcpy(&min_cost, buffer +4 +4 *u +2, 2);
-
-						dest = ntohs(dest);
-						min_cost = ntohs(min_cost);
-
-						if(get_myid() == dest) continue;
-
-						
-						if(curr_host != dest) {
-							struct rte *d_v = find_rte(dest);
-							struct rte *d_x = find_rte(neighbor_node);
-
-							if((int16_t)min_cost == -1) {
-								struct link *l = find_link_by_peer(dest);
-								if(l == 0x0) {
-									update_rte(dest, -1, dest);
-								} else { 
-									update_rte(dest, l->c, dest);
-								}
-								print_rte(find_rte(dest));
-								//send_all_neighbors();
-								send_all_neighbors_except(neighbor_node);
-							} else {
-								int cost_updated = 0;
-								if(min_cost != (d_v->c - d_x->c) && d_v->c != -1 && d_v->nh == neighbor_node) {
-									cost_updated = 1;
-								}
-								if((d_x->c + min_cost) < d_v->c || d_v->c == -1 || cost_updated == 1)  {
-									update_rte(dest, d_x->c + min_cost, neighbor_node);
-									print_rte(find_rte(dest));
-									//send_all_neighbors();
-									send_all_neighbors_except(neighbor_node);
-								}
-							}
-						}
-					}
-					//printf("-----------------------------\n");
-					//for(int bi = 0; bi<n; bi++) printf("%02x", buffer[bi]);
-					//printf("\n");
-				}
-			}
-			//print_rt();
 		}
+		for(int i = 0; i < ready; i++) {
+			struct link *l = (struct link *)events[i].data.ptr;
+			for(int r = 0; r < MAX_READS && receive_vector(l); r++);
+		}
+
+		now = tm_now();
+		while((t = tm_first()) && t->due <= now) {
+			struct timer fired = *t;
+			tm_pop();
 
-		time_t t1 = time(NULL);
-		double elapsed_sec = difftime(t1, t0);
-		if(elapsed_sec >= evset_interval) break;
-		int remain = evset_interval - elapsed_sec;
-		if(timeout_sec > remain) {
-			timeout_sec = remain < 1 ? 1 : remain;
+			if(fired.ty == _tm_evset) {
+				done = true;
+			} else {
+				dv_run_timer(&fired);
+			}
 		}
-		
 	}
-	//print_rt();
 
 }
 
+void dv_start_periodic(int pupdate_interval, long long first) {
+	g_pupdate = pupdate_interval;
+	tm_add(first, _tm_periodic, 0);
+}
+
+void dv_run_timer(struct timer *t) {
+	switch(t->ty)
+	{
+	case _tm_periodic:
+		send_periodic_updates();
+		tm_add(t->due + g_pupdate, _tm_periodic, 0);
+		break;
+	case _tm_trigger:
+		// a periodic update may have gone out instead
+		if(g_dv->trigger_at == t->due) send_triggered_updates();
+		break;
+	case _tm_route:
+		route_timer(t->n);
+		break;
+	default:
+		break;
+	}
+}
+
 // read current host's routing table, and send updates to all neighbors
 // TODO: implement this function
 // HINT: if you implemented a helper that handles sending to neighbors in `dispatch_single_event()`,
 // you can reuse that here!
+// a full table covers whatever a pending triggered update would have carried
 void send_periodic_updates() {
 	send_all_neighbors();
+	rt_clear_dirty();
+	g_dv->trigger_at = 0;
 }
\ No newline at end of file
@@ -1,8 +1,31 @@
 #ifndef _DV_H_
 #define _DV_H_
 
+#include <stdint.h>
+#include <sys/types.h>
 #include "es.h"
 
+struct link;
+struct timer;
+
+// protocol state of a node besides its links and routes; a simulation
+// keeps one for each node
+struct dv_state
+{
+    long long trigger_at; // when the pending triggered update goes out, 0 if none
+};
+
+struct dv_stats
+{
+    unsigned long msgs, bytes; // datagrams sent, and their payload
+    unsigned long changes;     // route changes
+    long long last_change;     // tm_now() of the last one
+};
+
+extern struct dv_state *g_dv;     // the node being worked on
+extern struct dv_stats g_dv_stats;
+extern bool dv_trace;             // print events and route changes
+
 void walk_event_set_list(int pupdate_interval, int evset_interval, int verbose);
 
 void process_event_set(struct el *es);
@@ -13,4 +36,13 @@ void dispatch_single_event(struct es *ev);
 
 void send_periodic_updates();
 
+// periodic updates of the current node, the first one due at first
+void dv_start_periodic(int pupdate_interval, long long first);
+
+// a datagram that came in over l
+void dv_receive(struct link *l, const uint8_t *buf, ssize_t n);
+
+// run a due timer of the current node
+void dv_run_timer(struct timer *t);
+
 #endif
\ No newline at end of file
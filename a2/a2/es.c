@@ -18,6 +18,7 @@
 #include "ls.h"
 #include "rt.h"
 #include "n2h.h"
+#include "sim.h"
 
 struct el *g_lst;
 
@@ -74,8 +75,8 @@ void add_to_last_es(e_type ev,
 	switch (ev)
 	{
 	case _es_link:
-		// a local event?
-		if ((peer0 == get_myid()) || peer1 == get_myid())
+		// a local event? (a simulation runs every node)
+		if ((peer0 == get_myid()) || peer1 == get_myid() || g_sim)
 			local_event = true;
 		break;
 	case _ud_link:
@@ -11,14 +11,18 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/epoll.h>
 #include "common.h"
 #include "ls.h"
 #include "queue.h"
 #include "n2h.h"
 #include "rt.h"
+#include "sim.h"
+
+#define LINK_RCVBUF (1 << 20)
 
 struct link *g_ls;
-static node g_host;
+int g_ls_ep = -1; // epoll set of link sockets, each registered with its link
 
 int create_ls()
 {
@@ -28,7 +32,12 @@ int create_ls()
 	g_ls->peer = g_ls->c = -1;
 	g_ls->name = 0x0;
 
-	g_host = get_myid();
+	// simulated links have no sockets
+	if (!g_sim)
+	{
+		g_ls_ep = epoll_create1(0);
+		assert(g_ls_ep >= 0);
+	}
 
 	return (g_ls != 0x0);
 }
@@ -63,6 +72,10 @@ int create_link_sock(int port)
 	server_address.sin_addr.s_addr = INADDR_ANY;
 	server_address.sin_port = htons(port);
 
+	// room for a whole vector of fragments; the kernel may cap this
+	int rcvbuf = LINK_RCVBUF;
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
 	if(bind(sockfd, (const struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
 		fprintf(stderr, "bind failed\n");
 		return -1; //exit(1);
@@ -71,6 +84,26 @@ int create_link_sock(int port)
 	return sockfd;
 }
 
+// path MTU to addr as the kernel knows it, DEFAULT_MTU if it cannot tell
+static int path_mtu(struct sockaddr_in *addr)
+{
+	int mtu = DEFAULT_MTU;
+	socklen_t len = sizeof(mtu);
+	int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (sockfd < 0)
+	{
+		return DEFAULT_MTU;
+	}
+	if (connect(sockfd, (const struct sockaddr *)addr, sizeof(*addr)) < 0 ||
+		getsockopt(sockfd, IPPROTO_IP, IP_MTU, &mtu, &len) < 0)
+	{
+		mtu = DEFAULT_MTU;
+	}
+	close(sockfd);
+	return mtu;
+}
+
 // add a link to the global link set
 int add_link(int host_port,
 			 node peer, int peer_port,
@@ -79,14 +112,17 @@ int add_link(int host_port,
 	struct in_addr peer_addr;
 	memset(&peer_addr, 0, sizeof(peer_addr));
 
-	const char* peer_hostname = gethostbynode(peer);
-	if(peer_hostname == NULL){
-		return -1;
-	}
+	if (!g_sim)
+	{
+		const char* peer_hostname = gethostbynode(peer);
+		if(peer_hostname == NULL){
+			return -1;
+		}
 
-	peer_addr = getaddrbyhost(peer_hostname);
-	if(peer_addr.s_addr == 0){
-		return -1;
+		peer_addr = getaddrbyhost(peer_hostname);
+		if(peer_addr.s_addr == 0){
+			return -1;
+		}
 	}
 
 	struct link *nl = (struct link *)malloc(sizeof(struct link));
@@ -104,6 +140,7 @@ int add_link(int host_port,
 	nl->peer_addr.sin_addr = peer_addr;
 
 	nl->peer_port = peer_port;
+	nl->mtu = g_sim ? DEFAULT_MTU : path_mtu(&nl->peer_addr);
 	nl->c = c;
 	nl->name = (char *)malloc(strlen(name) + 1);
 	if (!(nl->name))
@@ -113,6 +150,13 @@ int add_link(int host_port,
 	}
 	strcpy(nl->name, name);
 
+	if (g_sim)
+	{
+		nl->sockfd = -1;
+		InsertDQ(g_ls, nl);
+		return 1;
+	}
+
 	int rv = create_link_sock(nl->host_port);
 	if (rv < 0)
 	{
@@ -122,6 +166,18 @@ int add_link(int host_port,
 	}
 	nl->sockfd = rv;
 
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = nl;
+	if (epoll_ctl(g_ls_ep, EPOLL_CTL_ADD, nl->sockfd, &ev) < 0)
+	{
+		close(nl->sockfd);
+		free(nl->name);
+		free(nl);
+		return -1;
+	}
+
 	InsertDQ(g_ls, nl);
 	return 1;
 }
@@ -202,9 +258,12 @@ int del_link(char *name)
 	}
 	if (i->sockfd >= 0)
 	{
+		epoll_ctl(g_ls_ep, EPOLL_CTL_DEL, i->sockfd, 0x0);
 		close(i->sockfd);
 	}
 	DelDQ(i);
+	free(i->rx.seen);
+	free(i->rx.entries);
 	free(i->name);
 	free(i);
 	return 1;
@@ -214,7 +273,7 @@ void print_link(struct link *i)
 {
 	fprintf(stdout, "[ls]\t ----- link name(%s) ----- \n", i->name);
 	fprintf(stdout, "[ls]\t node(%d)host(%s)port(%d) <--> node(%d)host(%s)port(%d)\n",
-			g_host, gethostbynode(g_host), i->host_port,
+			get_myid(), gethostbynode(get_myid()), i->host_port,
 			i->peer, gethostbynode(i->peer), i->peer_port);
 	fprintf(stdout, "[ls]\t cost(%d), sock(%d)\n",
 			i->c, i->sockfd);
@@ -5,8 +5,23 @@
 #ifndef _LS_H_
 #define _LS_H_
 
+#include <stdint.h>
 #include <netinet/in.h>
 
+#define DEFAULT_MTU 1500
+
+// fragments of the vector the peer is sending, see dv.c
+struct reassembly
+{
+    bool started;  // seq is meaningful
+    bool complete; // vector seq has been applied
+    uint16_t seq;
+    uint16_t nfrags, got;
+    uint8_t *seen;    // per fragment
+    uint8_t *entries; // as on the wire
+    size_t len, cap;
+};
+
 struct link
 {
     struct link *next; // next entry
@@ -18,6 +33,9 @@ struct link
     int sockfd; // underlying socket for the link. Expected to be bound to link.host_port. Used for both sending and receiving
     cost c;     // cost
     char *name;
+    int mtu;      // path MTU to the peer, checked when the link is added
+    uint16_t seq; // number of the next vector sent over the link
+    struct reassembly rx;
 };
 
 int create_ls(); // Initalize module, should be called before any other link state functions, and after set_myid()
@@ -19,6 +19,7 @@
 #include "n2h.h"
 #include "queue.h"
 #include "rt.h"
+#include "sim.h"
 
 #define logf (stdout)
 
@@ -47,7 +48,8 @@ int add_n2h(node nid, char *hostname)
 	nl->nid = nid;
 
 	// NOTE: if your code stops here, you might want to double check if your modified /etc/hosts file is correct
-	assert(gethostbyname(hostname));
+	// (simulated nodes never leave this process, so their hosts need not exist)
+	assert(g_sim || gethostbyname(hostname));
 
 	nl->hostname = (char *)malloc(strlen(hostname) + 1);
 	strcpy(nl->hostname, hostname);
@@ -87,6 +89,30 @@ char *gethostbynode(node nid)
 	return 0x0;
 }
 
+/*
+ * All node ids, in list order; *count gets how many
+ */
+node *get_node_ids(int *count)
+{
+	struct n2h *i;
+	int n = 0;
+
+	for (i = g_n2h->next; i != g_n2h; i = i->next)
+	{
+		n++;
+	}
+
+	node *ids = (node *)malloc((n ? n : 1) * sizeof(node));
+	assert(ids);
+	n = 0;
+	for (i = g_n2h->next; i != g_n2h; i = i->next)
+	{
+		ids[n++] = i->nid;
+	}
+	*count = n;
+	return ids;
+}
+
 /*
  * Using node->hostname list to initiailize the routing table
  */
@@ -16,6 +16,7 @@ struct n2h
 // interface
 struct in_addr getaddrbyhost(const char* c); //0.0.0.0 if failure
 char *gethostbynode(node nid);
+node *get_node_ids(int *count); // malloc'ed
 
 // internal
 int create_n2h();
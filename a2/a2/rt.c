@@ -1,5 +1,5 @@
 /* $Id: rt.c,v 1.2 2000/02/23 00:51:25 bobby Exp bobby $
- * QD DQ implementation of RT
+ * Array implementation of RT, indexed by destination
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,56 +7,114 @@
 
 #include "common.h"
 #include "rt.h"
-#include "queue.h"
 
 #define logf (stdout)
+#define RT_MIN_SLOTS 64
 
-struct rte *g_rt;
+static struct rt g_rt0;
+struct rt *g_rt = &g_rt0; // the table being worked on
 
 int create_rt()
 {
-	InitDQ(g_rt, struct rte);
-	assert(g_rt);
-	g_rt->d = g_rt->c = g_rt->nh = -1;
-	return (g_rt != 0x0);
+	g_rt->size = RT_MIN_SLOTS;
+	g_rt->count = 0;
+	g_rt->e = (struct rte *)malloc(g_rt->size * sizeof(struct rte));
+	assert(g_rt->e);
+	for (node n = 0; n < g_rt->size; n++)
+	{
+		g_rt->e[n].d = NO_NODE;
+	}
+	return (g_rt->e != 0x0);
+}
+
+/* make room for destination n */
+static int grow_rt(node n)
+{
+	node size = g_rt->size;
+	while (size <= n)
+	{
+		size *= 2;
+	}
+
+	struct rte *e = (struct rte *)realloc(g_rt->e, size * sizeof(struct rte));
+	if (!e)
+	{
+		return 0;
+	}
+	for (node i = g_rt->size; i < size; i++)
+	{
+		e[i].d = NO_NODE;
+	}
+	g_rt->e = e;
+	g_rt->size = size;
+	return 1;
 }
 
 int add_rte(node n, cost c, node nh)
 {
-	struct rte *ne = (struct rte *)malloc(sizeof(struct rte));
+	if (n == NO_NODE || (n >= g_rt->size && !grow_rt(n)))
+	{
+		return 0;
+	}
+
+	struct rte *ne = &g_rt->e[n];
+	if (ne->d == NO_NODE)
+	{
+		g_rt->count++;
+	}
 	ne->d = n;
 	ne->c = c;
 	ne->nh = nh;
-
-	InsertDQ(g_rt, ne);
-	return (ne != 0x0);
+	ne->dirty = true;
+	ne->from = NO_NODE;
+	ne->expires = ne->held = 0;
+	ne->timed = false;
+	return 1;
 }
 
 struct rte *find_rte(node n)
 {
-	struct rte *i;
-
-	for (i = g_rt->next; i != g_rt; i = i->next)
-	{
-		if (i->d == n)
-			break;
-	}
-	if (i->d == n)
+	if (n < g_rt->size && g_rt->e[n].d == n)
 	{
-		return i;
+		return &g_rt->e[n];
 	}
-	else
+	return 0x0;
+}
+
+struct rte *rt_first()
+{
+	return find_rte(0) ? &g_rt->e[0] : rt_next(&g_rt->e[0]);
+}
+
+struct rte *rt_next(struct rte *i)
+{
+	for (i++; i < g_rt->e + g_rt->size; i++)
 	{
-		return 0x0;
+		if (i->d != NO_NODE)
+		{
+			return i;
+		}
 	}
+	return 0x0;
 }
 
 int update_rte(node n, cost c, node nh)
+{
+	return update_rte_from(n, c, nh, NO_NODE);
+}
+
+/* update a route as learned from neighbor from */
+int update_rte_from(node n, cost c, node nh, node from)
 {
 	struct rte *i = find_rte(n);
 
-	if (i->d == n)
+	if (i)
 	{
+		if (i->c != c || i->nh != nh)
+		{
+			i->dirty = true;
+			i->from = from;
+		}
 		i->c = c;
 		i->nh = nh;
 		return 0;
@@ -71,10 +129,10 @@ int del_rte(node n)
 {
 	struct rte *i = find_rte(n);
 
-	if (i->d == n)
+	if (i)
 	{
-		DelDQ(i);
-		free(i);
+		i->d = NO_NODE;
+		g_rt->count--;
 		return 0;
 	}
 	else
@@ -83,6 +141,17 @@ int del_rte(node n)
 	}
 }
 
+/* all routes have been advertised */
+void rt_clear_dirty()
+{
+	struct rte *i;
+
+	FOR_EACH_RTE(i)
+	{
+		i->dirty = false;
+	}
+}
+
 /* print route */
 void print_rte(struct rte *i)
 {
@@ -99,7 +168,7 @@ void print_rt()
 
 	fprintf(logf, "\n-- Routing table --\n");
 
-	for (i = g_rt->next; i != g_rt; i = i->next)
+	FOR_EACH_RTE(i)
 	{
 		print_rte(i);
 	}
@@ -4,20 +4,46 @@
 #ifndef _RT_H_
 #define _RT_H_
 
+#include "common.h"
+
+#define NO_NODE ((node)-1)
+
+// node ids are dense, so routes live in an array indexed by destination
+// and finding one is a single index. A slot whose d is NO_NODE holds no
+// route.
 struct rte
 {
-    struct rte *next; // next entry
-    struct rte *prev; // prev entry
-    node d;           // dest
-    cost c;           // cost
-    node nh;          // next hop
+    node d;     // dest
+    cost c;     // cost
+    node nh;    // next hop
+    bool dirty; // cost or next hop changed since it was last advertised
+    node from;  // neighbor whose update made the last change, NO_NODE if local
+    unsigned int expires; // tm_now() ms, when a route learned from a neighbor times out, 0 if it does not
+    unsigned int held;    // tm_now() ms, until when a lost route ignores other neighbors
+    bool timed;        // has a route timer pending
+};
+
+struct rt
+{
+    struct rte *e; // e[d] is the route to d
+    node size;     // slots in e
+    node count;    // routes
 };
 
+// visit every route in destination order
+#define FOR_EACH_RTE(i) for ((i) = rt_first(); (i); (i) = rt_next(i))
+
 int create_rt();
+// pointers returned by find_rte and the iterators stay valid until the
+// next add_rte
 int add_rte(node n, cost c, node nh);
 int update_rte(node n, cost c, node nh);
+int update_rte_from(node n, cost c, node nh, node from);
 int del_rte(node n);
 struct rte *find_rte(node n);
+struct rte *rt_first();
+struct rte *rt_next(struct rte *i);
+void rt_clear_dirty();
 void print_rte(struct rte *i);
 void print_rt();
 
@@ -7,11 +7,13 @@
 #include "es.h"
 #include "ls.h"
 #include "n2h.h"
+#include "sim.h"
 
 extern char *rutext;
 int rulex (void *x);
 int ruerror(char *s);
 int ru_line_num = 1;
+int ru_nodes = 0;
 %}
 
 %pure-parser
@@ -43,27 +45,33 @@ int ru_line_num = 1;
 
 %%
 
-ru: 
-{
-}
-|
-node_line ru
+config:
+ru
 {
     // identify myself
-    if (is_me(get_myid()) == false) {
+    if (ru_nodes > 0 && !g_sim && is_me(get_myid()) == false) {
 	printf("[ru] ==> given nodeid(%d)host(%s) is not localhost\n",
 	        get_myid(), gethostbynode(get_myid()));
         exit(1);
     }
+};
 
+/* lists are left recursive so the parser stack stays flat however many
+   nodes and events there are */
+ru: 
+{
+}
+|
+ru node_line
+{
 }
 |
-open_paren_n event_set close_paren nl ru
+ru open_paren_n event_set close_paren nl
 {
     //printf ("[ru]\tparsed an event set\n");
 }
 |
-open_paren_n nl event_set close_paren nl ru
+ru open_paren_n nl event_set close_paren nl
 {
     //printf ("[ru]\tparsed an event set\n");
 }
@@ -93,6 +101,7 @@ token_node number name_t nl
 
     // add to node_to_hostname
     assert (add_n2h($2, $3));
+    ru_nodes++;
 
     printf ("[ru]\tFound node %d %s\n", $2, $3);
 
@@ -100,15 +109,15 @@ token_node number name_t nl
 
 event_set: 
 |
-es_link event_set 
+event_set es_link
 {
 }
 |
-td_link event_set 
+event_set td_link
 {
 }
 |
-ud_link event_set
+event_set ud_link
 {
 }
 ;
@@ -0,0 +1,268 @@
+/* $Id$
+ * Simulation: every node of the config in one process
+ *
+ * Each node keeps its own link set, routing table and protocol state, and
+ * the code in dv.c runs on whichever node is current. The timer heap drives
+ * all of them on a simulated clock. Datagrams go through an in-memory
+ * queue and arrive SIM_LATENCY_MS after they were sent; with the same
+ * latency on every link the queue is also the order they arrive in.
+ */
+
+#ifndef _SIM_C_
+#define _SIM_C_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "common.h"
+#include "es.h"
+#include "ls.h"
+#include "rt.h"
+#include "n2h.h"
+#include "dv.h"
+#include "tm.h"
+#include "sim.h"
+
+#define SIM_LATENCY_MS 10
+
+bool g_sim = false;
+
+extern struct el *g_lst;  // parsed event sets
+extern struct link *g_ls; // current node's link set
+extern struct rt *g_rt;   // current node's routing table
+
+struct sim_node
+{
+	struct link *ls;
+	struct rt rt;
+	struct dv_state dv;
+};
+
+// a datagram in flight
+struct sim_msg
+{
+	node from, to;
+	size_t len;
+	uint8_t *data;
+};
+
+static struct sim_node **g_nodes; // by node id, 0x0 if not in the config
+static node g_nodes_size;
+
+static struct sim_msg *g_q; // ring, oldest first
+static size_t g_q_head, g_q_count, g_q_size;
+
+// make n the current node
+static void enter(node n)
+{
+	struct sim_node *s = g_nodes[n];
+
+	set_myid(n);
+	g_ls = s->ls;
+	g_rt = &s->rt;
+	g_dv = &s->dv;
+}
+
+static bool in_sim(node n)
+{
+	return n < g_nodes_size && g_nodes[n];
+}
+
+void sim_send(node to, const uint8_t *buf, size_t len)
+{
+	if (g_q_count == g_q_size)
+	{
+		size_t size = g_q_size ? g_q_size * 2 : 1024;
+		struct sim_msg *q = (struct sim_msg *)malloc(size * sizeof(*q));
+		assert(q);
+		for (size_t i = 0; i < g_q_count; i++)
+		{
+			q[i] = g_q[(g_q_head + i) % g_q_size];
+		}
+		free(g_q);
+		g_q = q;
+		g_q_head = 0;
+		g_q_size = size;
+	}
+
+	struct sim_msg *m = &g_q[(g_q_head + g_q_count++) % g_q_size];
+	m->from = get_myid();
+	m->to = to;
+	m->len = len;
+	m->data = (uint8_t *)malloc(len);
+	assert(m->data);
+	memcpy(m->data, buf, len);
+
+	tm_add_for(to, tm_now() + SIM_LATENCY_MS, _tm_deliver, m->from);
+}
+
+// the oldest datagram in flight arrives
+static void deliver()
+{
+	struct sim_msg m = g_q[g_q_head];
+	g_q_head = (g_q_head + 1) % g_q_size;
+	g_q_count--;
+
+	if (in_sim(m.to))
+	{
+		enter(m.to);
+		// the link may have been torn down while the datagram was on its way
+		for (struct link *l = g_ls->next; l != g_ls; l = l->next)
+		{
+			if (l->peer == m.from)
+			{
+				dv_receive(l, m.data, m.len);
+				break;
+			}
+		}
+	}
+	free(m.data);
+}
+
+static void add_node(node n)
+{
+	if (n >= g_nodes_size)
+	{
+		node size = g_nodes_size ? g_nodes_size : 64;
+		while (size <= n)
+		{
+			size *= 2;
+		}
+		g_nodes = (struct sim_node **)realloc(g_nodes, size * sizeof(*g_nodes));
+		assert(g_nodes);
+		memset(g_nodes + g_nodes_size, 0, (size - g_nodes_size) * sizeof(*g_nodes));
+		g_nodes_size = size;
+	}
+
+	struct sim_node *s = (struct sim_node *)calloc(1, sizeof(*s));
+	assert(s);
+	g_nodes[n] = s;
+
+	enter(n);
+	create_ls();
+	s->ls = g_ls;
+	create_rt();
+	init_rt_from_n2h();
+}
+
+// an event goes to both ends of its link
+static void dispatch_event_set(struct el *es)
+{
+	for (struct es *ev = es->es_head->next; ev != es->es_head; ev = ev->next)
+	{
+		struct es *link = ev->ev_ty == _es_link ? ev : geteventbylink(ev->name);
+		if (!link)
+		{
+			continue;
+		}
+		if (in_sim(link->peer0))
+		{
+			enter(link->peer0);
+			dispatch_single_event(ev);
+		}
+		if (in_sim(link->peer1) && link->peer1 != link->peer0)
+		{
+			enter(link->peer1);
+			dispatch_single_event(ev);
+		}
+	}
+}
+
+// run every node until simulated time end
+static void run_until(long long end)
+{
+	tm_add_for(NO_NODE, end, _tm_evset, 0);
+
+	for (;;)
+	{
+		struct timer t = *tm_first();
+		tm_pop();
+		tm_advance(t.due);
+
+		switch (t.ty)
+		{
+		case _tm_evset:
+			return;
+		case _tm_deliver:
+			deliver();
+			break;
+		default:
+			if (in_sim(t.at))
+			{
+				enter(t.at);
+				dv_run_timer(&t);
+			}
+			break;
+		}
+	}
+}
+
+static double wall_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void sim_run(int pupdate_interval, int evset_interval, int verbose)
+{
+	int count;
+	node *ids = get_node_ids(&count);
+
+	if (pupdate_interval < 1)
+	{
+		pupdate_interval = 1;
+	}
+	if (evset_interval < 1)
+	{
+		evset_interval = 1;
+	}
+
+	dv_trace = verbose;
+	tm_simulate();
+
+	// nodes come up spread over one periodic interval, as they would by hand
+	for (int i = 0; i < count; i++)
+	{
+		add_node(ids[i]);
+		dv_start_periodic(pupdate_interval, (long long)pupdate_interval * (i + 1) / count);
+	}
+
+	printf("[sim] %d nodes, periodic updates every %d ms, event sets every %d ms, %d ms per hop\n",
+		   count, pupdate_interval, evset_interval, SIM_LATENCY_MS);
+
+	int set = 0;
+	for (struct el *es = g_lst->next; es != g_lst; es = es->next)
+	{
+		struct dv_stats before = g_dv_stats;
+		long long start = tm_now();
+		double wall = wall_now();
+
+		dispatch_event_set(es);
+		run_until(start + evset_interval);
+
+		unsigned long changes = g_dv_stats.changes - before.changes;
+		printf("[sim] event set %d: %lu route changes, last at +%lld ms; %lu messages, %lu bytes; %.3f s\n",
+			   set++, changes, changes ? g_dv_stats.last_change - start : 0,
+			   g_dv_stats.msgs - before.msgs, g_dv_stats.bytes - before.bytes,
+			   wall_now() - wall);
+
+		if (verbose)
+		{
+			for (int i = 0; i < count; i++)
+			{
+				enter(ids[i]);
+				printf("\n[sim] node %d", ids[i]);
+				print_rt();
+			}
+		}
+	}
+
+	free(ids);
+}
+
+#endif
@@ -0,0 +1,18 @@
+/* $Id$
+ * Simulation: every node of the config in one process
+ */
+#ifndef _SIM_H_
+#define _SIM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "common.h"
+
+extern bool g_sim; // set before the config is parsed
+
+// hand a datagram from the current node to its neighbor to
+void sim_send(node to, const uint8_t *buf, size_t len);
+// run the event sets on every node, intervals in ms of simulated time
+void sim_run(int pupdate_interval, int evset_interval, int verbose);
+
+#endif
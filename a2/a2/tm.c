@@ -0,0 +1,116 @@
+/* $Id$
+ * Timers, kept in a binary min-heap by due time
+ */
+#include <stdlib.h>
+#include <time.h>
+
+#include "common.h"
+#include "tm.h"
+#include "n2h.h"
+
+#define TM_MIN_SLOTS 64
+
+static struct timer *g_tm = 0x0;
+static int g_tm_count = 0;
+static int g_tm_size = 0;
+
+static long long g_tm_epoch = -1;   // monotonic ms at the first tm_now()
+static long long g_tm_virtual = -1; // simulated now, -1 on the real clock
+
+long long tm_now()
+{
+	struct timespec ts;
+
+	if (g_tm_virtual >= 0)
+	{
+		return g_tm_virtual;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	long long now = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+	if (g_tm_epoch < 0)
+	{
+		g_tm_epoch = now;
+	}
+	return now - g_tm_epoch;
+}
+
+void tm_simulate()
+{
+	g_tm_virtual = 0;
+}
+
+void tm_advance(long long now)
+{
+	if (now > g_tm_virtual)
+	{
+		g_tm_virtual = now;
+	}
+}
+
+int tm_add(long long due, tm_type ty, node n)
+{
+	return tm_add_for(get_myid(), due, ty, n);
+}
+
+int tm_add_for(node at, long long due, tm_type ty, node n)
+{
+	if (g_tm_count == g_tm_size)
+	{
+		int size = g_tm_size ? g_tm_size * 2 : TM_MIN_SLOTS;
+		struct timer *t = (struct timer *)realloc(g_tm, size * sizeof(struct timer));
+		if (!t)
+		{
+			return 0;
+		}
+		g_tm = t;
+		g_tm_size = size;
+	}
+
+	int i = g_tm_count++;
+	while (i > 0 && due < g_tm[(i - 1) / 2].due)
+	{
+		g_tm[i] = g_tm[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	g_tm[i].due = due;
+	g_tm[i].ty = ty;
+	g_tm[i].n = n;
+	g_tm[i].at = at;
+	return 1;
+}
+
+struct timer *tm_first()
+{
+	return g_tm_count ? &g_tm[0] : 0x0;
+}
+
+void tm_pop()
+{
+	if (!g_tm_count)
+	{
+		return;
+	}
+
+	struct timer *last = &g_tm[--g_tm_count];
+	int i = 0;
+	while (1)
+	{
+		int child = 2 * i + 1;
+		if (child >= g_tm_count)
+		{
+			break;
+		}
+		if (child + 1 < g_tm_count && g_tm[child + 1].due < g_tm[child].due)
+		{
+			child++;
+		}
+		if (last->due <= g_tm[child].due)
+		{
+			break;
+		}
+		g_tm[i] = g_tm[child];
+		i = child;
+	}
+	g_tm[i] = *last;
+}
@@ -0,0 +1,36 @@
+/* $Id$
+ * Timer heap
+ */
+#ifndef _TM_H_
+#define _TM_H_
+
+#include "common.h"
+
+typedef enum
+{
+    _tm_periodic, // send the whole table to every neighbor
+    _tm_evset,    // the current event set's time is up
+    _tm_trigger,  // send what changed
+    _tm_route,    // check route n for a timeout
+    _tm_deliver   // simulation: the next message in flight arrives
+} tm_type;
+
+struct timer
+{
+    long long due; // ms on the timer clock
+    tm_type ty;
+    node n;
+    node at; // node the timer belongs to
+};
+
+// ms since the first call, or simulated time once tm_simulate() is called
+long long tm_now();
+void tm_simulate();              // time stands still but for tm_advance
+void tm_advance(long long now);
+
+int tm_add(long long due, tm_type ty, node n); // for the current node
+int tm_add_for(node at, long long due, tm_type ty, node n);
+struct timer *tm_first(); // earliest timer, 0x0 if none
+void tm_pop();            // drop the earliest timer
+
+#endif